@@ -23,7 +23,40 @@
  THE SOFTWARE.
  */
 
+#define _GNU_SOURCE           // CPU affinity, see FLEET RUNNER
 #include <ncurses.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+// from <linux/input.h>, which can't be included with ncurses : KEY_ macros
+struct input_event{ struct timeval time; uint16_t type, code; int32_t value; };
+struct input_absinfo{ int32_t value, minimum, maximum, fuzz, flat, resolution; };
+#define EVIOCGABS(abs) _IOR('E', 0x40 + (abs), struct input_absinfo)
+#define EV_KEY 0x01
+#define EV_ABS 0x03
+#define ABS_X  0x00
+#define ABS_Y  0x01
+#define ABS_RX 0x03
+#define ABS_RY 0x04
+#endif
 
 #define CARRY     0x01
 #define ZERO      0x02
@@ -38,8 +71,37 @@
 #define ROMSIZE   0x3000    // 12KB
 #define RAMSIZE   0xC000    // 48KB
 
+#define ALLROWS   0xFFFFFF  // the 24 text rows
+
+#define SNAPSLOTS    256        // snapshots kept for reverse execution
+#define SNAPINTERVAL 1000000    // cycles between two snapshots, ~1s of guest time
+
 uint8_t rom[ROMSIZE];
-uint8_t ram[RAMSIZE];
+uint8_t firstRam[2 * RAMSIZE];  // main RAM, then the auxiliary RAM of -x
+uint8_t *ram = firstRam;        // of the machine running, see LINKED MACHINES
+uint8_t firstWritten[2 * RAMSIZE >> 8];  // pages written, set by each write
+uint8_t *written = firstWritten;
+
+#define REHASH  1               // written[] : to hash again, see STATE-SPACE EXPLORATION
+#define RESTORE 2               // to copy back, see INSTANCE POOL
+#define WRITTEN (REHASH | RESTORE)
+
+#define READY 16                // blocks kept for a machine not running
+
+struct Tier{                    // RAM pages decoded, see SHARED BLOCKS
+  const struct Decoded *blocks[RAMSIZE >> 8];
+  uint16_t heat[RAMSIZE >> 8];
+  const struct Shared *ready[READY];  // decoded while another machine ran
+  uint8_t readyPages[READY], readyCount;
+}firstTier, *tier = &firstTier; // of the machine running
+
+static void stale(uint16_t address){  // code written, back to the interpreter
+  if (tier->blocks[address >> 8]) tier->blocks[address >> 8] = NULL;
+}
+
+static void dropBlocks(){       // all of RAM written
+  memset(tier->blocks, 0, sizeof(tier->blocks));
+}
 
 struct Operand{
   bool setAcc;
@@ -49,29 +111,577 @@ struct Operand{
 struct Register{
   uint8_t A,X,Y,SR,SP;
   uint16_t PC;
-}reg;
+}reg, ref;                    // ref is the lockstep reference core
+
+struct Access{                // a memory access, as logged in lockstep mode
+  uint16_t address;
+  uint8_t value;
+}ioReads[8], writes[8];
+
+int ioCount = 0, writeCount = 0;
+bool lockstep = false;        // differential testing against the reference core
 
 uint8_t key = 0;
-bool videoNeedsRefresh = true;
+uint32_t dirtyRows[2] = {ALLROWS, ALLROWS};  // text rows to redraw, by bank
+
+uint64_t ticks = 0;           // CPU cycles elapsed since power on
+int watch = -1;               // watched address for reverse-continue, -1 if none
+uint64_t watchHit;            // start cycle of the last write to watch
+bool watchFound;
+
+
+// BASIC LINE PROFILER
+
+// With -p FILE the guest cycles are charged to the BASIC line being run,
+// the report is written at exit. It costs nothing but on writes to the
+// interpreter's current line : Applesoft keeps the line number in CURLIN
+// ($75-$76), Integer BASIC a pointer to the line in $DC-$DD, the number
+// being after the length byte, and bit 7 of $D9 set while a program runs.
+// Both bytes are not written at once, a line lasting less than SETTLE
+// cycles is such a transient, not a real line. The cycles spent waiting for
+// a key are not charged : the KEYIN loop increments RNDL ($4E) every 15 to
+// 19 cycles, and the program may well have ended without telling.
+
+#define SETTLE 20
+
+struct LineStat{
+  uint64_t hits, cycles;
+}*lineStats = NULL;           // indexed by line number
+
+bool profiling = false, applesoft = false;
+uint64_t lineStart = 0;       // cycle at which the current line started
+int lineNumber = -1;          // current line, -1 in direct mode
+uint64_t lastPoll = 0, idle = 0, totalIdle = 0;  // keyboard wait
+
+static int currentLine(){
+  uint16_t pointer = ram[0xDC] | (ram[0xDD] << 8);
+  int line = ram[0x75] | (ram[0x76] << 8);
+  if (applesoft) return(line > 63999 ? -1 : line);  // $FFxx in direct mode
+  if (!(ram[0xD9] & 0x80) || pointer >= RAMSIZE - 2) return(-1);
+  return(ram[pointer + 1] | (ram[pointer + 2] << 8));
+}
+
+static void lineChange(){
+  if (ticks - lineStart >= SETTLE){
+    if (lineNumber >= 0){
+      lineStats[lineNumber].hits++;
+      lineStats[lineNumber].cycles += ticks - lineStart - idle;
+    }
+    totalIdle += idle;
+    idle = 0;
+    lineStart = ticks;
+  }
+  lineNumber = currentLine();
+}
+
+static void profileWrite(uint16_t address){  // a write to the zero page
+  if (address == 0x4E){
+    if (ticks - lastPoll < 32) idle += ticks - lastPoll;
+    lastPoll = ticks;
+  }
+  else if (applesoft ? (uint16_t)(address - 0x75) < 2 : (uint16_t)(address - 0xDC) < 2)
+    lineChange();
+  else if (!applesoft && address == 0xD9 && currentLine() != lineNumber)
+    lineChange();
+}
+
+static int byCycles(const void *a, const void *b){
+  uint64_t ca = lineStats[*(int*)a].cycles, cb = lineStats[*(int*)b].cycles;
+  return(ca < cb ? 1 : ca > cb ? -1 : 0);
+}
+
+static void writeProfile(const char *filename){
+  static int lines[65536];
+  int count = 0;
+  uint64_t total = 0;
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) return;
+  lineChange();
+  for (int line=0; line<65536; line++)
+    if (lineStats[line].hits){
+      lines[count++] = line;
+      total += lineStats[line].cycles;
+    }
+  qsort(lines, count, sizeof(int), byCycles);
+  fprintf(f, "%llu cycles in BASIC lines, %llu waiting for keys\n",
+    (unsigned long long)total, (unsigned long long)totalIdle);
+  fprintf(f, " LINE        HITS        CYCLES      %%\n");
+  for (int i=0; i<count; i++)
+    fprintf(f, "%5d %11llu %13llu %6.2f\n", lines[i],
+      (unsigned long long)lineStats[lines[i]].hits,
+      (unsigned long long)lineStats[lines[i]].cycles,
+      100.0 * lineStats[lines[i]].cycles / total);
+  fclose(f);
+}
+
+
+// TYPE-AHEAD
+
+// Typed and pasted keys are queued with the cycle they were typed at, the
+// guest gets the next one as soon as it reads KBD after the strobe. The
+// queue is never emptied : it is also the key log replayed when going back
+// in time, snapshots only keep the index of the next key to deliver.
+
+struct Typed{
+  uint64_t ticks;
+  uint8_t key;
+}*typed = NULL;
+
+size_t typedCount = 0, typedSize = 0, typedNext = 0;
+
+static void typeKey(uint8_t k){
+  if (typedCount == typedSize){
+    typedSize = typedSize ? typedSize * 2 : 1024;
+    typed = realloc(typed, typedSize * sizeof(struct Typed));
+  }
+  typed[typedCount].ticks = ticks;
+  typed[typedCount++].key = k;
+}
+
+
+// PADDLES AND BUTTONS
+
+// A read of PDL0-PDL3 has bit 7 set until paddle value * 11 cycles after
+// the last PTRIG access. Nothing counts down, the bit is computed from the
+// cycle of the trigger, and PREAD ($FB1E) finds the exact value as its loop
+// takes 11 cycles. When it is that loop reading, it is run to its last pass
+// at once, leaving the registers and cycle count it would have given (not
+// with -l, nor in the coverage build). The loop is known by the address of
+// the instruction reading, the PC has moved on by then, further when decoded.
+// A headless run prints how many reads were so fast-forwarded.
+
+#define PADDLECYCLES 11
+#define PREAD        0xFB1E
+
+uint8_t paddles[4] = {255, 255, 255, 255};  // 255 : no paddle connected
+uint8_t buttons = 0;                        // bit n is PBn
+uint64_t paddleTrigger = 0;                 // cycle of the last PTRIG
+bool preadInRom = false;                    // the ROM has the usual PREAD
+uint16_t opcodePC = 0;                      // of the instruction running
+uint64_t paddleReads = 0, paddleSkips = 0;  // reads, fast-forwarded ones
+
+static uint8_t readPaddle(int n){
+  uint64_t end = paddleTrigger + paddles[n] * PADDLECYCLES;
+  paddleReads++;
+  if (preadInRom && opcodePC == PREAD + 7 && reg.Y == 0 && ticks < end && !lockstep){
+    reg.Y = (end - ticks + PADDLECYCLES - 1) / PADDLECYCLES;  // the loop counter
+    ticks += reg.Y * PADDLECYCLES;
+    paddleSkips++;
+  }
+  return(ticks < end ? 0x80 : 0);
+}
+
+
+// VIDEO SCANNER
+
+// The video hardware reads a byte of RAM each cycle : 65 cycles per line,
+// the last 40 visible, 262 lines per frame, the first 192 visible. Where it
+// is is computed from the cycle counter when needed, as in "Understanding
+// the Apple II" (Sather, chapter 5). Reads of unmapped I/O addresses get
+// that byte, the floating bus some programs synchronize with.
+
+#define TEXT    0x01          // soft switches, set by $C051, $C053, $C055, $C057
+#define MIXED   0x02
+#define PAGE2   0x04
+#define HIRES   0x08
+#define COL80   0x10          // with -x, see 80-COLUMN CARD
+#define DHIRES  0x20
+#define STORE80 0x40
+
+#define LINECYCLES  65
+#define FRAMECYCLES (65 * 262)
+#define READCYCLE   3         // LDA and BIT abs read on their 4th cycle
+
+uint8_t video = TEXT;
+bool card80 = false;          // -x
+
+static uint16_t scannerAddress(){
+  uint32_t cycle = (ticks + READCYCLE) % FRAMECYCLES;
+  uint32_t h = cycle % LINECYCLES;    // horizontal counter : 0, $40-$7F
+  uint32_t v = cycle / LINECYCLES;    // vertical counter : $100-$1FF, $FA-$FF
+  uint16_t address;
+  if (h) h += 0x3F;
+  v += v < 256 ? 0x100 : 0xFA - 256;
+  address = (h & 7) | (v & 0x38) << 4                              // A0-A2, A7-A9
+          | ((0xD + ((h >> 3) & 7) + ((v >> 6) & 3) * 5) & 0xF) << 3;  // A3-A6
+  if (video & HIRES && !(video & TEXT) && !(video & MIXED && (v & 0xA0) == 0xA0))
+    return(address | (v & 7) << 10 | ((video & (PAGE2|STORE80)) == PAGE2 ? 0x4000 : 0x2000));
+  return(address | ((video & (PAGE2|STORE80)) == PAGE2 ? 0x800 : 0x400) | (h < 0x58 ? 0x1000 : 0));
+}
+
+static uint8_t floatingBus(){
+  return(ram[scannerAddress()]);
+}
+
+// A change of the soft switches is logged with its cycle. Once per frame
+// the log gives the mode of each text row, at the scanline in its middle :
+// mixed mode or a mode switched mid-frame. Without changes, the whole frame
+// is in the same mode and the log is empty.
+
+#define VIDEOLOGSIZE 256
+
+struct VideoChange{
+  uint64_t ticks;
+  uint8_t video;
+}videoLogs[4][VIDEOLOGSIZE], *videoLog = videoLogs[0];  // by machine
+
+int videoLogCount = 0;
+uint8_t frameVideo = TEXT;    // soft switches at the start of the logged frames
+uint8_t rowModes[24];         // soft switches for each text row
+
+static void mapBanks();
+
+static void setVideo(uint8_t mode){
+  bool remap = (video | mode) & STORE80;
+  if (mode == video) return;
+  video = mode;
+  if (remap) mapBanks();
+  if (videoLogCount == VIDEOLOGSIZE) videoLogCount--;  // keep the last change
+  videoLog[videoLogCount++] = (struct VideoChange){ticks, video};
+  dirtyRows[0] = dirtyRows[1] = ALLROWS;
+}
+
+static void softSwitch(uint16_t address){  // $C050-$C05F
+  uint8_t bit = 1 << ((address >> 1) & 3);
+  if (address < 0xC058) setVideo(address & 1 ? video | bit : video & ~bit);
+  else if (address >= 0xC05E && card80)      // AN3, cleared for double hi-res
+    setVideo(address & 1 ? video & ~DHIRES : video | DHIRES);
+}
+
+static void endFrame(){  // rowModes for the last complete frame
+  uint64_t start = ticks < FRAMECYCLES ? 0 : (ticks / FRAMECYCLES - 1) * FRAMECYCLES;
+  int n = 0, row = 0;
+  uint8_t mode = frameVideo;
+  while (n < videoLogCount && videoLog[n].ticks < start) mode = videoLog[n++].video;
+  if (n < videoLogCount && videoLog[n].ticks < start + FRAMECYCLES)
+    for (; row < 24; row++){                 // changes during the frame
+      while (n < videoLogCount && videoLog[n].ticks < start + (row * 8 + 4) * LINECYCLES)
+        mode = videoLog[n++].video;
+      rowModes[row] = mode;
+    }
+  memset(rowModes + row, mode, 24 - row);    // the whole frame fast path
+  while (n < videoLogCount && videoLog[n].ticks < start + FRAMECYCLES) mode = videoLog[n++].video;
+  memmove(videoLog, videoLog + n, (videoLogCount - n) * sizeof(struct VideoChange));
+  videoLogCount -= n;
+  frameVideo = mode;
+}
+
+
+// 80-COLUMN CARD
+
+// -x adds an extended 80-column card as in the Apple IIe : 48K of auxiliary
+// RAM, in ram[] after the main RAM. Writes to $C002-$C005 bank it in for
+// reads (RAMRD) and writes (RAMWRT) from $0200 ; zero page and the stack
+// follow ALTZP ($C008-$C009) only. With 80STORE ($C000-$C001), PAGE2
+// banks in the text page instead, and the hi-res page with HIRES. 80COL
+// ($C00C-$C00D) and AN3 ($C05E-$C05F) give 80-column text and double hi-res,
+// the aux byte of each column is displayed first. The switches are read
+// back at $C013-$C01F, bit 7, with the VBL status at $C019.
+
+#define RAMRD  0x01
+#define RAMWRT 0x02
+#define ALTZP  0x04
+
+uint8_t banks = 0;                                     // RAMRD, RAMWRT and ALTZP
+uint32_t readOffset[RAMSIZE >> 8], writeOffset[RAMSIZE >> 8];  // of each page
+
+static void mapBanks(){
+  uint32_t page2 = video & PAGE2 ? RAMSIZE : 0;
+  for (int page=0; page<(RAMSIZE >> 8); page++){
+    uint32_t read = readOffset[page];
+    readOffset[page]  = banks & (page < 2 ? ALTZP : RAMRD)  ? RAMSIZE : 0;
+    writeOffset[page] = banks & (page < 2 ? ALTZP : RAMWRT) ? RAMSIZE : 0;
+    if (video & STORE80 && ((page >= 0x04 && page < 0x08)
+        || (video & HIRES && page >= 0x20 && page < 0x40)))
+      readOffset[page] = writeOffset[page] = page2;
+    if (readOffset[page] != read) stale(page << 8);  // the code of the other bank
+  }
+}
+
+static void cardSwitch(uint16_t address){  // writes to $C000-$C00F
+  switch (address & 0xE){
+    case 0x0: setVideo(address & 1 ? video | STORE80 : video & ~STORE80); break;
+    case 0x2: banks = address & 1 ? banks | RAMRD  : banks & ~RAMRD;  mapBanks(); break;
+    case 0x4: banks = address & 1 ? banks | RAMWRT : banks & ~RAMWRT; mapBanks(); break;
+    case 0x8: banks = address & 1 ? banks | ALTZP  : banks & ~ALTZP;  mapBanks(); break;
+    case 0xC: setVideo(address & 1 ? video | COL80 : video & ~COL80); break;
+  }
+}
+
+static uint8_t cardStatus(uint16_t address){  // reads of $C011-$C01F
+  uint32_t line = (ticks + READCYCLE) % FRAMECYCLES / LINECYCLES;
+  bool on = false;
+  switch (address & 0xF){
+    case 0x3: on = banks & RAMRD;    break;
+    case 0x4: on = banks & RAMWRT;   break;
+    case 0x6: on = banks & ALTZP;    break;
+    case 0x8: on = video & STORE80;  break;
+    case 0x9: on = line < 192;       break;    // not in vertical blank
+    case 0xA: on = video & TEXT;     break;
+    case 0xB: on = video & MIXED;    break;
+    case 0xC: on = video & PAGE2;    break;
+    case 0xD: on = video & HIRES;    break;
+    case 0xF: on = video & COL80;    break;
+  }
+  return((on ? 0x80 : 0) | (key & 0x7F));
+}
+
+
+// MEMORY CARD
+
+// -m FILE puts a host file in slot 4, mapped in memory. The 2K window at
+// $C800-$CFFF shows bank n of the file, n being the 32 bit number written
+// to $C0C0-$C0C3, low byte first, and $C0C4-$C0C7 read the number of banks.
+// Reads past the end of the file give 0 and writes there are lost, other
+// writes go to the file unless it is read only. Nothing is copied, a guest
+// can scan gigabytes. The window is always on, there is no other card. The
+// file is not in the snapshots : going back in time does not undo writes.
+
+#define MAPSLOT 0xC0C0        // slot 4 I/O
+#define MAPBANK 0x800         // bytes in the window
+
+uint8_t *mapData = NULL;      // the file, mmap'ed
+uint64_t mapSize = 0;
+bool mapWritable = false;
+uint32_t mapBank = 0;         // bank in the window
+
+static bool openMapFile(const char *filename){
+  struct stat st;
+  int fd = open(filename, O_RDWR);
+  mapWritable = fd >= 0;
+  if (fd < 0) fd = open(filename, O_RDONLY);
+  if (fd < 0) return(false);
+  if (fstat(fd, &st) || st.st_size == 0){ close(fd); return(false); }
+  mapData = mmap(NULL, st.st_size, PROT_READ | (mapWritable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+  close(fd);                                     // the mapping stays
+  if (mapData == MAP_FAILED){ mapData = NULL; return(false); }
+  mapSize = st.st_size;
+  return(true);
+}
+
+static bool mapped(uint16_t address){            // $C0C0-$C0C7 and $C800-$CFFF
+  return(mapData && ((address & 0xFFF8) == MAPSLOT || address >= 0xC800));
+}
+
+static uint8_t mapRead(uint16_t address){
+  uint64_t offset = (uint64_t)mapBank * MAPBANK + (address & (MAPBANK - 1));
+  if (address >= 0xC800) return(offset < mapSize ? mapData[offset] : 0);
+  if (address & 4) return(((mapSize + MAPBANK - 1) / MAPBANK) >> ((address & 3) * 8));
+  return(mapBank >> ((address & 3) * 8));
+}
+
+static void mapWrite(uint16_t address, uint8_t value){
+  uint64_t offset = (uint64_t)mapBank * MAPBANK + (address & (MAPBANK - 1));
+  int shift = (address & 3) * 8;
+  if (address >= 0xC800){ if (offset < mapSize && mapWritable) mapData[offset] = value; }
+  else if (!(address & 4)) mapBank = (mapBank & ~(0xFFu << shift)) | (uint32_t)value << shift;
+}
+
+
+// LINKED MACHINES
+
+// -L FILE adds a machine, with the keys of FILE for a headless run. They
+// are cabled by pairs, 0 with 1, 2 with 3, through Super Serial Cards in
+// slot 2 : the 6551 ACIA at $C0A8-$C0AB, without interrupts. What one sends
+// is in the ring of the other, due when its last bit is in at the baud rate
+// set. All share the ROM and the options, and each has its own RAM, CPU,
+// cycle counter, keyboard and switches, swapped in and out of the globals.
+// They run by turns of QUANTUM cycles, less than a byte at 19200 baud, on
+// one timeline, so a run is deterministic. F9 shows the next machine.
+// Reverse execution and -l take a single machine.
+
+#define MACHINES 4
+#define QUANTUM  500
+#define SSC      0xC0A8        // slot 2
+#define RINGSIZE 4096
+#define CPUHZ    (FRAMECYCLES * 60)
+
+struct Acia{
+  uint8_t data, status, command, control;  // status : overrun, the rest is computed
+  uint64_t txFree;                         // cycle the transmitter is free
+}acia;
+
+struct Ring{                               // bytes received, with their cycle
+  uint8_t data[RINGSIZE];
+  uint64_t due[RINGSIZE];
+  unsigned head, tail;
+}rings[MACHINES];
+
+#define MACHINESTATE(copy) copy(ram) copy(reg) copy(ticks) copy(key) copy(dirtyRows) \
+  copy(typed) copy(typedCount) copy(typedSize) copy(typedNext) copy(paddles) \
+  copy(buttons) copy(paddleTrigger) copy(video) copy(videoLog) copy(videoLogCount) \
+  copy(frameVideo) copy(banks) copy(mapBank) copy(acia) copy(profiling) copy(tier) \
+  copy(written)
+
+struct Machine{                            // the globals of the others
+  uint8_t *ram;
+  struct Register reg;
+  uint64_t ticks;
+  uint8_t key;
+  uint32_t dirtyRows[2];
+  struct Typed *typed;
+  size_t typedCount, typedSize, typedNext;
+  uint8_t paddles[4], buttons;
+  uint64_t paddleTrigger;
+  uint8_t video;
+  struct VideoChange *videoLog;
+  int videoLogCount;
+  uint8_t frameVideo, banks;
+  uint32_t mapBank;
+  struct Acia acia;
+  bool profiling;                          // -p : the first machine
+  struct Tier *tier;
+  uint8_t *written;
+}machines[MACHINES];
+
+static void takeReady();
+
+int machineCount = 1, current = 0;         // the one in the globals
+uint64_t timeline = 0;                     // where all machines are
+
+#define SAVE(v) memcpy(&m->v, &v, sizeof(v));
+#define LOAD(v) memcpy(&v, &m->v, sizeof(v));
+
+static void switchMachine(int n){
+  struct Machine *m = &machines[current];
+  if (n == current) return;
+  MACHINESTATE(SAVE)
+  m = &machines[n];
+  MACHINESTATE(LOAD)
+  current = n;
+  if (card80) mapBanks();
+  if (tier->readyCount) takeReady();
+}
+
+static void addMachine(){                  // a copy of the first at power on
+  struct Machine *m = &machines[machineCount];
+  MACHINESTATE(SAVE)
+  m->ram = calloc(2, RAMSIZE);
+  m->tier = calloc(1, sizeof(struct Tier));
+  m->written = calloc(2, RAMSIZE >> 8);
+  m->videoLog = videoLogs[machineCount++];
+  m->profiling = false;
+}
+
+static uint64_t byteCycles(){              // start bit, data, parity, stop bits
+  static const uint32_t baud[16] = {115200, 50, 75, 110, 135, 150, 300, 600,
+    1200, 1800, 2400, 3600, 4800, 7200, 9600, 19200};
+  int bits = 1 + 8 - ((acia.control >> 5) & 3) + (acia.command & 0x20 ? 1 : 0)
+    + (acia.control & 0x80 ? 2 : 1);
+  return((uint64_t)CPUHZ * bits / baud[acia.control & 0xF]);
+}
+
+static uint8_t aciaRead(uint16_t address){
+  struct Ring *rx = &rings[current];
+  bool full = rx->head != rx->tail && rx->due[rx->head % RINGSIZE] <= ticks;
+  switch (address & 3){
+    case 0:  if (full) acia.data = rx->data[rx->head++ % RINGSIZE];
+             return(acia.data);
+    case 1:  return((full ? 0x08 : 0) | (ticks >= acia.txFree ? 0x10 : 0) | acia.status);
+    case 2:  return(acia.command);
+    default: return(acia.control);
+  }
+}
+
+static void aciaWrite(uint16_t address, uint8_t value){
+  int peer = current ^ 1;
+  struct Ring *tx = &rings[peer];
+  switch (address & 3){
+    case 0:                                // transmit
+      acia.txFree = (ticks > acia.txFree ? ticks : acia.txFree) + byteCycles();
+      if (peer >= machineCount) break;
+      if (tx->tail - tx->head == RINGSIZE){ machines[peer].acia.status |= 0x04; break; }
+      tx->data[tx->tail % RINGSIZE] = value;
+      tx->due[tx->tail++ % RINGSIZE] = acia.txFree;
+      break;
+    case 1:  acia.command &= 0xE0; acia.status = 0; break;  // programmed reset
+    case 2:  acia.command = value; break;
+    default: acia.control = value; break;
+  }
+}
+
+static void step();
+
+static void runMachines(uint64_t until){   // all of them, by turns
+  int shown = current;
+  while (timeline < until){
+    uint64_t end = timeline + QUANTUM < until ? timeline + QUANTUM : until;
+    for (int n=0; n<machineCount; n++){
+      switchMachine(n);
+      while (ticks < end) step();
+    }
+    timeline = end;
+  }
+  switchMachine(shown);
+}
 
 
 // MEMORY AND I/O
 
-static uint8_t readMem(uint16_t address){
-  if (address <  RAMSIZE)  return(ram[address]);
-  if (address >= ROMSTART) return(rom[address - ROMSTART]);
-  if (address == 0xC000)   return(key);          // KBD
+static uint8_t readIO(uint16_t address){
+  if (address == 0xC000){                        // KBD
+    if (key < 0x80 && typedNext < typedCount && typed[typedNext].ticks <= ticks)
+      key = typed[typedNext++].key;              // next key of the queue
+    return(key);
+  }
   if (address == 0xC010){                        // KBDSTRB
     key &= 0x7F;                                 // unset bit 7
     return(key);
   }
-  return(0);                                     // catch all
+  if ((address & 0xFFF0) == 0xC060){             // cassette in, buttons, paddles
+    if (address & 4) return(readPaddle(address & 3) | (floatingBus() & 0x7F));
+    if (address & 3) return(((buttons >> ((address & 3) - 1)) & 1 ? 0x80 : 0)
+                            | (floatingBus() & 0x7F));   // PB0-PB2
+  }
+  if ((address & 0xFFF0) == 0xC010 && card80) return(cardStatus(address));
+  if ((address & 0xFFF0) == 0xC050) softSwitch(address);
+  if ((address & 0xFFF0) == 0xC070) paddleTrigger = ticks;   // PTRIG
+  if (mapped(address)) return(mapRead(address));
+  if ((address & 0xFFFC) == SSC && machineCount > 1) return(aciaRead(address));
+  return(floatingBus());                         // catch all
+}
+
+static uint8_t readMem(uint16_t address){
+  if (address <  RAMSIZE)  return(ram[address + readOffset[address >> 8]]);
+  if (address >= ROMSTART) return(rom[address - ROMSTART]);
+  uint8_t value = readIO(address);
+  if (lockstep && ioCount < 8) ioReads[ioCount++] = (struct Access){address, value};
+  return(value);
+}
+
+static uint8_t peek(uint16_t address){           // readMem without side effects
+  if (address <  RAMSIZE)  return(ram[address + readOffset[address >> 8]]);
+  if (address >= ROMSTART) return(rom[address - ROMSTART]);
+  return(0);
+}
+
+static uint32_t rowBit(uint16_t address){  // text row showing a video byte
+  if (((uint16_t)(address - 0x400) < 0x800 || (uint16_t)(address - 0x2000) < 0x4000)
+      && (address & 0x7F) < 120)
+    return(1 << (((address >> 7) & 7) + (address & 0x7F) / 40 * 8));
+  return(0);                                     // not in a video page, or a hole
 }
 
 static void writeMem(uint16_t address, uint8_t value){
-  if (address & 0x400) videoNeedsRefresh = true; // a change in text page 1
-  if (address < RAMSIZE) ram[address] = value;
+  if (address == watch){                         // watchpoint, see reverseContinue
+    watchHit = ticks;
+    watchFound = true;
+  }
+  if (lockstep && writeCount < 8) writes[writeCount++] = (struct Access){address, value};
+  if (address < RAMSIZE){
+    uint32_t offset = writeOffset[address >> 8];
+    dirtyRows[offset != 0] |= rowBit(address);   // a change in a video page
+    stale(address);
+    written[(address + offset) >> 8] = WRITTEN;
+    ram[address + offset] = value;
+  }
   else if (address == 0xC010) key &= 0x7F;       // KBDSTRB, as in readMem
+  else if ((address & 0xFFF0) == 0xC070) paddleTrigger = ticks;  // PTRIG
+  else if ((address & 0xFFF0) == 0xC050) softSwitch(address);
+  else if ((address & 0xFFF0) == 0xC000 && card80) cardSwitch(address);
+  else if (mapped(address)) mapWrite(address, value);
+  else if ((address & 0xFFFC) == SSC && machineCount > 1) aciaWrite(address, value);
+  if (profiling && address < 0x100) profileWrite(address);
 }
 
 
@@ -94,6 +704,10 @@ static void setSZ(uint8_t value){  //  update both the Sign & Zero FLAGS
 
 static void reset(){  // the reset vector is in $FFFC
   reg.PC = readMem(0xFFFC) | (readMem(0xFFFD) << 8);
+  ref.PC = reg.PC;
+  banks = 0;                                           // the IIe resets its switches
+  setVideo(video & ~(COL80 | DHIRES | STORE80));
+  mapBanks();
 }
 
 
@@ -180,7 +794,7 @@ static void NOP(){  // NO Operation
 static void BRK(){  // BReaK
   push(((++reg.PC) >> 8) & 0xFF);
   push(reg.PC & 0xFF);
-  push(reg.SR | BREAK);
+  push(reg.SR | BREAK | UNDEFINED);
   reg.SR |= INTERRUPT;
   reg.PC = readMem(0xFFFE) | (readMem(0xFFFF) << 8);
 }
@@ -287,36 +901,41 @@ static void TXS(){  // Transfer X to Sp
   reg.SP = reg.X;
 }
 
+static void branch(){  // taken : one more cycle, two to another page
+  ticks += ((reg.PC + ope.address) ^ reg.PC) & 0xFF00 ? 2 : 1;
+  reg.PC += ope.address;
+}
+
 static void BEQ(){  // Branch on EQual (zero set)
-  if (reg.SR & ZERO) reg.PC += ope.address;
+  if (reg.SR & ZERO) branch();
 }
 
 static void BNE(){  // Branch on Not Equal (zero clear)
-  if (!(reg.SR & ZERO)) reg.PC += ope.address;
+  if (!(reg.SR & ZERO)) branch();
 }
 
 static void BMI(){  // Branch if MInus (ie when negative, when SIGN is set)
-  if (reg.SR & SIGN) reg.PC += ope.address;
+  if (reg.SR & SIGN) branch();
 }
 
 static void BPL(){  // Branch if PLus (ie when positive, when SIGN is clear)
-  if (!(reg.SR & SIGN)) reg.PC += ope.address;
+  if (!(reg.SR & SIGN)) branch();
 }
 
 static void BVS(){  // Branch on oVerflow Set
-  if (reg.SR & OVERFLOW) reg.PC += ope.address;
+  if (reg.SR & OVERFLOW) branch();
 }
 
 static void BVC(){  // Branch on oVerflow Clear
-  if (!(reg.SR & OVERFLOW)) reg.PC += ope.address;
+  if (!(reg.SR & OVERFLOW)) branch();
 }
 
 static void BCS(){  // Branch on Carry Set
-  if (reg.SR & CARRY) reg.PC +=ope.address;
+  if (reg.SR & CARRY) branch();
 }
 
 static void BCC(){  // Branch on Carry Clear
-  if (!(reg.SR & CARRY)) reg.PC += ope.address;
+  if (!(reg.SR & CARRY)) branch();
 }
 
 static void PHA(){  // PusH A to the stack
@@ -328,7 +947,7 @@ static void PLA(){  // PulL stack into A
 }
 
 static void PHP(){  // PusH Programm (Status) register to the stack
-  push(reg.SR | BREAK);
+  push(reg.SR | BREAK | UNDEFINED);
 }
 
 static void PLP(){  // PulL stack into Programm (SR) register
@@ -431,7 +1050,12 @@ static void ADC(){  // ADd with Carry
   setSZ(result);
   if (((result)^(reg.A )) & ((result)^(ope.value)) & 0x80) reg.SR |= OVERFLOW;
   else reg.SR &= ~OVERFLOW;
-  if (reg.SR&DECIMAL) result += ((((result+0x66)^reg.A^ope.value)>>3) & 0x22)*3;
+  if (reg.SR & DECIMAL){  // 6502.org/tutorials/decimal_mode.html, appendix A
+    uint16_t low = (reg.A & 0x0F) + (ope.value & 0x0F) + (reg.SR & CARRY);
+    if (low > 0x09) low = ((low + 0x06) & 0x0F) + 0x10;
+    result = (reg.A & 0xF0) + (ope.value & 0xF0) + low;
+    if (result > 0x9F) result += 0x60;
+  }
   if (result & 0xFF00) reg.SR |= CARRY;
   else reg.SR &= ~CARRY;
   reg.A = (result & 0xFF);
@@ -439,12 +1063,17 @@ static void ADC(){  // ADd with Carry
 
 static void SBC(){  // SuBtract with Carry : forum.6502.org/viewtopic.php?t=475
   ope.value ^= 0xFF;
-  if (reg.SR & DECIMAL) ope.value -= 0x66;
   uint16_t result = reg.A + ope.value + (reg.SR & CARRY);
-  setSZ(result);
+  setSZ(result);     // like on the NMOS 6502 flags are those of the binary sum
   if (((result)^(reg.A )) & ((result)^(ope.value)) & 0x80) reg.SR |= OVERFLOW;
   else reg.SR &= ~OVERFLOW;
-  if (reg.SR&DECIMAL) result += ((((result+0x66)^reg.A^ope.value)>>3) & 0x22)*3;
+  if (reg.SR & DECIMAL){  // same source, the carry stays the binary one
+    int low = (reg.A & 0x0F) + (ope.value & 0x0F) + (reg.SR & CARRY) - 0x10;
+    if (low < 0) low = ((low - 0x06) & 0x0F) - 0x10;
+    int bcd = (reg.A & 0xF0) - (~ope.value & 0xF0) + low;
+    if (bcd < 0) bcd -= 0x60;
+    result = (result & 0xFF00) | (bcd & 0xFF);
+  }
   if (result & 0xFF00) reg.SR |= CARRY;
   else reg.SR &= ~CARRY;
   reg.A = (result & 0xFF);
@@ -494,79 +1123,2978 @@ static void (*addressing[])(void) = {
  REL, IDY, IMP, IMP, IMP, ZPX, ZPX, IMP, IMP, ABY, IMP, IMP, IMP, ABX, ABX, IMP
 };
 
+static const uint8_t cycles[] = {  // base cycle count of each opcode
+ 7, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 2, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,
+ 6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 4, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,
+ 6, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 3, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,
+ 6, 6, 2, 2, 2, 3, 5, 2, 4, 2, 2, 2, 5, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,
+ 2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,
+ 2, 6, 2, 2, 4, 4, 4, 2, 2, 5, 2, 2, 2, 5, 2, 2,
+ 2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,
+ 2, 5, 2, 2, 4, 4, 4, 2, 2, 4, 2, 2, 4, 4, 4, 2,
+ 2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,
+ 2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,
+ 2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2
+};
 
-// PROGRAM ENTRY POINT
+// TIERED EXECUTION
 
-int main(int argc, char *argv[]) {
+// Code is first interpreted, fetching the opcode and operands through
+// readMem(). Each page counts the instructions interpreted in it, at HOT
+// it is queued to a thread decoding it in the background : the opcode, the
+// operand and the addressing mode taking it without a fetch, for each of
+// its 256 addresses. The CPU never waits, it runs the interpreter until
+// the block is published with an atomic store, then takes the decoded one,
+// an instruction at a time as before. ROM never changes, a block is never
+// invalidated and all linked machines share it. RAM pages are decoded from
+// a copy and shared by content, see SHARED BLOCKS.
+// There is no JIT tier : host code for each guest block, exact to the cycle
+// and the I/O access, would take an assembler per host CPU and executable
+// memory, for less than the decoded blocks give on a 1 MHz guest, and
+// reverse execution, lockstep and coverage need the instruction boundary.
 
-  const uint16_t offsetsForRows[24] = {  // helper for video generation
-    0x400, 0x480, 0x500, 0x580, 0x600, 0x680, 0x700, 0x780,
-    0x428, 0x4A8, 0x528, 0x5A8, 0x628, 0x6A8, 0x728, 0x7A8,
-    0x450, 0x4D0, 0x550, 0x5D0, 0x650, 0x6D0, 0x750, 0x7D0
-  };
-  uint8_t opcode, glyph;
-  int ch;
+#define PAGES     (ROMSIZE >> 8)
+#define HOT       256              // instructions interpreted before decoding
+#define QUEUESIZE 64               // a power of 2
 
-  // ncurses initialization
-  initscr();
-  raw();
-  noecho();
-  curs_set(0);
-  qiflush();
-  keypad   (stdscr, TRUE);
-  nodelay  (stdscr, TRUE);
-  scrollok (stdscr, FALSE);
+struct Decoded{                    // no pointer, see TRANSLATION CACHE
+  uint16_t operand;
+  uint8_t opcode, mode;            // mode : index in decodedModes[]
+};
 
-  // load the original Apple][ ROM, including the Programmer's Aid at $D000
-  FILE *f=fopen("appleII.rom","rb");
-  if (f != NULL) fread(rom, sizeof(uint8_t), ROMSIZE, f);
-  fclose(f);
+struct Decoded *_Atomic blocks[PAGES];  // published by the decoder thread
+uint16_t heat[PAGES];
+uint16_t operand;                  // of the decoded instruction running
 
-  // processor reset
-  reset();
+struct Request{                    // a page to decode
+  struct Tier *tier;               // NULL for ROM
+  uint8_t page;
+  uint8_t code[256];               // RAM, as it was
+}queue[QUEUESIZE];                 // single producer and consumer
 
-  // main loop
-  while(1){
-    for (int i=0; i<100; i++){    // execute 100 instructions before a kbd scan
-      opcode = readMem(reg.PC++); // FETCH and increment the Program Counter
-      addressing[opcode]();       // DECODE operands against the addressing mode
-      instruction[opcode]();      // EXECUTE the instruction
+atomic_uint queueHead, queueTail;
+sem_t queued;
+bool decoder = false;              // thread started
+
+static void preIMM(){ ope.address = reg.PC++; ope.value = operand & 0xFF; }
+static void preZPG(){ reg.PC++; ope.address = operand & 0xFF; ope.value = readMem(ope.address); }
+static void preZPX(){ reg.PC++; ope.address = (operand + reg.X) & 0xFF; ope.value = readMem(ope.address); }
+static void preZPY(){ reg.PC++; ope.address = (operand + reg.Y) & 0xFF; ope.value = readMem(ope.address); }
+static void preREL(){ reg.PC++; ope.address = (int8_t)operand; }
+static void preABS(){ reg.PC += 2; ope.address = operand; ope.value = readMem(ope.address); }
+static void preABX(){ reg.PC += 2; ope.address = operand + reg.X; ope.value = readMem(ope.address); }
+static void preABY(){ reg.PC += 2; ope.address = operand + reg.Y; ope.value = readMem(ope.address); }
+
+static void preIND(){
+  uint16_t vector2 = (operand & 0xFF00) | ((operand + 1) & 0x00FF);
+  reg.PC += 2;
+  ope.address = readMem(operand) | (readMem(vector2) << 8);
+  ope.value = readMem(ope.address);
+}
+
+static void preIDX(){
+  uint16_t vector1 = (operand + reg.X) & 0xFF;
+  reg.PC++;
+  ope.address = readMem(vector1) | (readMem((vector1 + 1) & 0x00FF) << 8);
+  ope.value = readMem(ope.address);
+}
+
+static void preIDY(){
+  uint16_t vector1 = operand & 0xFF;
+  reg.PC++;
+  ope.address = (readMem(vector1) | (readMem((vector1 + 1) & 0x00FF) << 8)) + reg.Y;
+  ope.value = readMem(ope.address);
+}
+
+#define FETCHING 13                // modes fetching their operands, then the others
+
+static void (*const decodedModes[])(void) = {
+  IMP, ACC, IMM, ZPG, ZPX, ZPY, REL, ABS, ABX, ABY, IND, IDX, IDY,
+  preIMM, preZPG, preZPX, preZPY, preREL, preABS, preABX, preABY, preIND, preIDX, preIDY
+};
+
+static void decode(const uint8_t *code, uint32_t size, struct Decoded *block){
+  for (uint32_t i=0; i<256; i++){  // size : bytes there from the page start
+    uint8_t opcode = code[i], mode = 0;
+    while (decodedModes[mode] != addressing[opcode]) mode++;
+    block[i] = (struct Decoded){0, opcode, mode};
+    if (i + 2 >= size || mode < 2) continue;  // operand past the end, or none
+    block[i].operand = code[i + 1] | code[i + 2] << 8;
+    block[i].mode = mode + FETCHING - 2;
+  }
+}
+
+static struct Decoded *decodePage(int page){  // of ROM
+  struct Decoded *block = malloc(256 * sizeof(struct Decoded));
+  decode(rom + (page << 8), ROMSIZE - (page << 8), block);
+  return(block);
+}
+
+static uint32_t fnv(uint32_t hash, const uint8_t *data, size_t size){  // FNV-1a
+  while (size--) hash = (hash ^ *data++) * 16777619u;
+  return(hash);
+}
+
+static void shareBlock(const struct Request *request);
+static void takeBlocks();
+
+static void *decodeThread(void *unused){
+  while (1){
+    sem_wait(&queued);
+    unsigned head = atomic_load_explicit(&queueHead, memory_order_relaxed);
+    struct Request *request = &queue[head % QUEUESIZE];
+    if (request->tier) shareBlock(request);
+    else if (!atomic_load_explicit(&blocks[request->page], memory_order_relaxed))
+      atomic_store_explicit(&blocks[request->page], decodePage(request->page),
+                            memory_order_release);
+    atomic_store_explicit(&queueHead, head + 1, memory_order_release);
+  }
+  return(NULL);
+}
+
+static void startDecoder(){
+  pthread_t thread;
+  sem_init(&queued, 0, 0);
+  decoder = !pthread_create(&thread, NULL, decodeThread, NULL);
+}
+
+unsigned pending = 0;              // RAM pages queued, not taken yet
+
+static void warm(uint16_t pc){     // an instruction interpreted, in ROM or RAM
+  bool inRom = pc >= ROMSTART;
+  int page = inRom ? (pc - ROMSTART) >> 8 : pc >> 8;
+  uint16_t *h = inRom ? &heat[page] : &tier->heat[page];
+  if (pending) takeBlocks();
+  if (++*h != HOT || !decoder) return;
+  unsigned tail = atomic_load_explicit(&queueTail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&queueHead, memory_order_acquire) == QUEUESIZE
+      || (!inRom && pending == QUEUESIZE)){
+    *h = 0;                        // full, try again later
+    return;
+  }
+  struct Request *request = &queue[tail % QUEUESIZE];
+  request->tier = inRom ? NULL : tier;
+  request->page = page;
+  if (!inRom){
+    memcpy(request->code, ram + readOffset[page] + (page << 8), 256);
+    pending++;
+  }
+  atomic_store_explicit(&queueTail, tail + 1, memory_order_release);
+  sem_post(&queued);
+}
+
+
+// SHARED BLOCKS
+
+// A RAM page is decoded from the copy queued with it, its 256 bytes are
+// hashed and looked up in a store of the pages decoded so far : machines
+// running the same program, or loading it again, share one block and only
+// the first decodes it. The store belongs to the decoder thread and its
+// blocks never change. The CPU installs a block coming back only if its
+// page still has these bytes, and a write to the page, or a bank switch
+// there, drops the block of that machine, not the shared one : it goes
+// back to the interpreter until the new code is hot. Operands past the
+// page are fetched, a block does not depend on the next one. A block
+// decoded for a linked or pooled machine that is not running is kept in
+// its tier, READY of them, and installed when it runs again.
+
+#define SHAREDSIZE 4096            // pages in the store, a power of 2
+
+struct Shared{
+  uint8_t code[256];
+  struct Decoded block[256];
+}*shared[SHAREDSIZE];              // by hash, the decoder thread's
+unsigned sharedCount = 0;
+
+struct Result{
+  struct Tier *tier;
+  uint8_t page;
+  const struct Shared *shared;     // NULL when the store is full
+}results[QUEUESIZE];               // from the decoder, single producer and consumer
+
+atomic_uint resultHead, resultTail;
+
+static void shareBlock(const struct Request *request){  // in the decoder thread
+  uint32_t slot = fnv(2166136261u, request->code, 256) % SHAREDSIZE;
+  while (shared[slot] && memcmp(shared[slot]->code, request->code, 256))
+    slot = (slot + 1) % SHAREDSIZE;
+  if (!shared[slot] && sharedCount < SHAREDSIZE * 3 / 4){
+    shared[slot] = malloc(sizeof(struct Shared));
+    memcpy(shared[slot]->code, request->code, 256);
+    decode(request->code, 256, shared[slot]->block);
+    sharedCount++;
+  }
+  unsigned tail = atomic_load_explicit(&resultTail, memory_order_relaxed);
+  results[tail % QUEUESIZE] = (struct Result){request->tier, request->page, shared[slot]};
+  atomic_store_explicit(&resultTail, tail + 1, memory_order_release);
+}
+
+static void install(uint8_t page, const struct Shared *decoded){  // in this machine
+  if (decoded && !memcmp(decoded->code, ram + readOffset[page] + (page << 8), 256))
+    tier->blocks[page] = decoded->block;
+  else tier->heat[page] = 0;                   // changed since
+}
+
+static void takeBlocks(){          // install the blocks decoded for this machine
+  unsigned tail = atomic_load_explicit(&resultTail, memory_order_acquire);
+  unsigned head = atomic_load_explicit(&resultHead, memory_order_relaxed);
+  for (; head != tail; head++, pending--){
+    struct Result *r = &results[head % QUEUESIZE];
+    if (r->tier == tier) install(r->page, r->shared);
+    else if (r->shared && r->tier->readyCount < READY){  // another machine's, for later
+      r->tier->ready[r->tier->readyCount] = r->shared;
+      r->tier->readyPages[r->tier->readyCount++] = r->page;
     }
+    else r->tier->heat[r->page] = 0;
+  }
+  atomic_store_explicit(&resultHead, head, memory_order_release);
+}
 
-    // slow down emulation
-    napms(0.6);
-
-    // keyboard controller
-    if ((key < 0x80) && ((ch = getch()) != ERR)){
-      if (ch == KEY_F( 7)) reset();                      // F7, processor reset
-      if (ch == KEY_F(12)) { endwin(); return(0); }      // F12, exit program
-      switch(key=(uint8_t)ch){                           // key translations
-        case 0x0A: key = 0x0D; break;                    // LF    to CR
-        case 0x04: key = 0x08; break;                    // LEFT  to BS
-        case 0x05: key = 0x15; break;                    // RIGHT to NAK
-        case 0x07: key = 0x08; break;                    // BELL  to BS (!?)
-      }
-      if ((key>0x60) && (key<0x7B)) key&=0xDF;           // to upper case
-      key |= 0x80;                                       // set bit 7
-    }
-
-    // video controller - page 1 text mode only
-    if (videoNeedsRefresh){                              // if content changed
-      videoNeedsRefresh = false;
-      for (int row=0; row<24; row++){                    // for each row
-        move(row,0);
-        for (int col=0; col<40; col++){                  // for each column
-          glyph = ram[offsetsForRows[row] + col];        // read video memory
-          if (glyph == '`') glyph = '_';                 // change cursor shape
-          if (glyph < 0x40) attrset(A_REVERSE);          // is REVERSE ?
-          else if (glyph > 0x7F) attrset(A_NORMAL);      // is NORMAL ?
-          else attrset(A_BLINK);                         // is FLASHING ?
-          glyph &= 0x7F;                                 // unset bit 7
-          if (glyph > 0x5F) glyph &= 0x3F;               // shifts to match
-          if (glyph < 0x20) glyph |= 0x40;               // the ASCII codes
-          addch(glyph);                                  // print the glyph
-        }
-      }
+static void takeReady(){           // those kept for this machine, when it runs
+  for (int n=0; n<tier->readyCount; n++) install(tier->readyPages[n], tier->ready[n]);
+  tier->readyCount = 0;
+}
+
+
+// TRANSLATION CACHE
+
+// -t FILE keeps the decoded ROM blocks from one run to the next. At exit
+// they are written after a header with the hash of the ROM and the version
+// of the decoding, at start the file is mapped and if both match its blocks
+// are published at once : a short run starts with the pages that were hot
+// decoded. Each block is checked against a decoding of its ROM page, all of
+// its entries with their operands : a damaged file is not used at all, the
+// pages are decoded when hot as without -t. The entries have no pointer,
+// they are used where they are mapped. The file is written aside then renamed, runs sharing it always
+// see a whole one.
+
+#define DECODEVERSION 1            // of struct Decoded and decodedModes[]
+
+struct CacheHeader{
+  char magic[4];                   // "R2TC"
+  uint32_t version, hash;
+  uint32_t blockCount;
+  uint64_t pages;                  // bit n : page n is in the file, in order
+};
+
+static uint32_t wholeRomHash(){
+  return(fnv(2166136261u, rom, ROMSIZE));
+}
+
+static void loadCache(const char *file){
+  struct stat st;
+  struct CacheHeader *header;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return;                            // not written yet
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct CacheHeader)){
+    close(fd);
+    return;
+  }
+  header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) return;
+  struct Decoded *block = (struct Decoded *)(header + 1), fresh[256];
+  bool valid = !memcmp(header->magic, "R2TC", 4) && header->version == DECODEVERSION
+    && header->hash == wholeRomHash() && (uint64_t)st.st_size == sizeof(struct CacheHeader)
+    + (uint64_t)header->blockCount * 256 * sizeof(struct Decoded)
+    && header->blockCount == (uint32_t)__builtin_popcountll(header->pages)
+    && header->pages >> PAGES == 0;
+  for (int page=0, n=0; valid && page<PAGES; page++){  // what the ROM decodes to
+    if (!(header->pages >> page & 1)) continue;
+    decode(rom + (page << 8), ROMSIZE - (page << 8), fresh);
+    valid = !memcmp(block + n++ * 256, fresh, sizeof(fresh));
+  }
+  if (!valid){
+    munmap(header, st.st_size);
+    return;
+  }
+  for (int page=0; page<PAGES; page++)
+    if (header->pages >> page & 1){
+      atomic_store_explicit(&blocks[page], block, memory_order_release);
+      block += 256;
+    }
+}
+
+static void saveCache(const char *file){
+  struct CacheHeader header = {"R2TC", DECODEVERSION, wholeRomHash(), 0, 0};
+  struct Decoded *block[PAGES];
+  char temp[strlen(file) + 16];
+  for (int page=0; page<PAGES; page++)
+    if ((block[page] = atomic_load_explicit(&blocks[page], memory_order_acquire))){
+      header.pages |= 1ULL << page;
+      header.blockCount++;
     }
+  snprintf(temp, sizeof(temp), "%s.%d", file, (int)getpid());
+  FILE *f = fopen(temp, "wb");
+  if (f == NULL) return;
+  bool written = fwrite(&header, sizeof(header), 1, f) == 1;
+  for (int page=0; page<PAGES; page++)
+    if (block[page]) written &= fwrite(block[page], sizeof(struct Decoded), 256, f) == 256;
+  if (fclose(f) || !written || rename(temp, file)) remove(temp);
+}
+
+
+// DISASSEMBLER
+
+static const char mnemonics[] =    // 3 letters per opcode, ??? if undefined
+ "BRKORA?????????ORAASL???PHPORAASL??????ORAASL???"
+ "BPLORA?????????ORAASL???CLCORA?????????ORAASL???"
+ "JSRAND??????BITANDROL???PLPANDROL???BITANDROL???"
+ "BMIAND?????????ANDROL???SECAND?????????ANDROL???"
+ "RTIEOR?????????EORLSR???PHAEORLSR???JMPEORLSR???"
+ "BVCEOR?????????EORLSR???CLIEOR?????????EORLSR???"
+ "RTSADC?????????ADCROR???PLAADCROR???JMPADCROR???"
+ "BVSADC?????????ADCROR???SEIADC?????????ADCROR???"
+ "???STA??????STYSTASTX???DEY???TXA???STYSTASTX???"
+ "BCCSTA??????STYSTASTX???TYASTATXS??????STA??????"
+ "LDYLDALDX???LDYLDALDX???TAYLDATAX???LDYLDALDX???"
+ "BCSLDA??????LDYLDALDX???CLVLDATSX???LDYLDALDX???"
+ "CPYCMP??????CPYCMPDEC???INYCMPDEX???CPYCMPDEC???"
+ "BNECMP?????????CMPDEC???CLDCMP?????????CMPDEC???"
+ "CPXSBC??????CPXSBCINC???INXSBCNOP???CPXSBCINC???"
+ "BEQSBC?????????SBCINC???SEDSBC?????????SBCINC???";
+
+static const struct{             // operand syntax of each addressing mode
+  void (*mode)(void);
+  const char *format;
+  int length;
+}modes[] = {
+  {IMM, "#$%02X", 2}, {ZPG, "$%02X", 2}, {ZPX, "$%02X,X", 2}, {ZPY, "$%02X,Y", 2},
+  {IDX, "($%02X,X)", 2}, {IDY, "($%02X),Y", 2}, {REL, "$%04X", 2}, {ABS, "$%04X", 3},
+  {ABX, "$%04X,X", 3}, {ABY, "$%04X,Y", 3}, {IND, "($%04X)", 3}, {ACC, "A", 1}
+};
+
+static int modeOf(uint8_t opcode){  // index in modes[], -1 if IMPlicit
+  for (int i=0; i<sizeof(modes)/sizeof(modes[0]); i++)
+    if (addressing[opcode] == modes[i].mode) return(i);
+  return(-1);
+}
+
+static int disassemble(uint16_t address, char *line){  // returns the length
+  uint8_t opcode = peek(address), op1 = peek(address + 1), op2 = peek(address + 2);
+  int operand, length = 1, n, mode = modeOf(opcode);
+  const char *format = "";
+  if (mode >= 0){
+    format = modes[mode].format;
+    length = modes[mode].length;
+  }
+  if (length == 3) operand = op1 | (op2 << 8);
+  else if (addressing[opcode] == REL) operand = (address + 2 + (int8_t)op1) & 0xFFFF;
+  else operand = op1;
+  n = sprintf(line, "%04X  %02X ", address, opcode);
+  n += sprintf(line + n, length > 1 ? "%02X " : "   ", op1);
+  n += sprintf(line + n, length > 2 ? "%02X " : "   ", op2);
+  n += sprintf(line + n, " %.3s ", mnemonics + opcode * 3);
+  sprintf(line + n, format, operand);
+  return(length);
+}
+
+
+// LOCKSTEP REFERENCE CORE
+
+// A second, deliberately naive 6502 decoding the opcodes from their bit
+// fields. With -l it runs side by side with the table driven core above,
+// registers and memory writes are compared after each instruction and the
+// emulator stops on the first divergence. I/O is not part of the CPU : the
+// reference reads back the values the main core got from readIO().
+
+uint8_t refRam[2 * RAMSIZE];
+struct Access refWrites[8];
+int ioNext = 0, refWriteCount = 0;
+uint16_t history[16];                      // last instructions, for the report
+unsigned long historyCount = 0;
+
+static void lockstepFail(const char *what){
+  char line[40];
+  endwin();
+  fprintf(stderr, "lockstep : %s differ, cycle %llu\n", what, (unsigned long long)ticks);
+  for (unsigned long i=historyCount>16?historyCount-16:0; i<historyCount; i++){
+    disassemble(history[i % 16], line);
+    fprintf(stderr, "  %s\n", line);
   }
+  fprintf(stderr, "  core PC:%04X A:%02X X:%02X Y:%02X SR:%02X SP:%02X  writes",
+    reg.PC, reg.A, reg.X, reg.Y, reg.SR, reg.SP);
+  for (int i=0; i<writeCount; i++)
+    fprintf(stderr, " $%04X=%02X", writes[i].address, writes[i].value);
+  fprintf(stderr, "\n  ref  PC:%04X A:%02X X:%02X Y:%02X SR:%02X SP:%02X  writes",
+    ref.PC, ref.A, ref.X, ref.Y, ref.SR, ref.SP);
+  for (int i=0; i<refWriteCount; i++)
+    fprintf(stderr, " $%04X=%02X", refWrites[i].address, refWrites[i].value);
+  fprintf(stderr, "\n");
+#ifdef FUZZ
+  abort();
+#endif
+  exit(1);
 }
+
+static void syncReference(){  // after anything the CPU did not do itself
+  ref = reg;
+  memcpy(refRam, ram, card80 ? 2 * RAMSIZE : RAMSIZE);
+  ioCount = writeCount = 0;
+}
+
+static uint8_t refRead(uint16_t address){
+  if (address <  RAMSIZE)  return(refRam[address + readOffset[address >> 8]]);
+  if (address >= ROMSTART) return(rom[address - ROMSTART]);
+  while (ioNext < ioCount)                 // the core may read more than us
+    if (ioReads[ioNext++].address == address) return(ioReads[ioNext-1].value);
+  lockstepFail("I/O reads");
+  return(0);
+}
+
+static void refWrite(uint16_t address, uint8_t value){
+  if (refWriteCount < 8) refWrites[refWriteCount++] = (struct Access){address, value};
+  if (address < RAMSIZE) refRam[address + writeOffset[address >> 8]] = value;
+}
+
+static void refPush(uint8_t value){
+  refWrite(0x100 | ref.SP--, value);
+}
+
+static uint8_t refPull(){
+  return(refRead(0x100 | ++ref.SP));
+}
+
+static uint8_t refNZ(uint8_t value){
+  ref.SR = (ref.SR & ~(SIGN | ZERO)) | (value & SIGN) | (value ? 0 : ZERO);
+  return(value);
+}
+
+static void refFlag(uint8_t flag, bool set){
+  ref.SR = set ? ref.SR | flag : ref.SR & ~flag;
+}
+
+static uint16_t refAddress(uint8_t op){  // effective address from the bbb field
+  uint8_t cc = op & 3, zp;
+  uint16_t address;
+  bool useY = (cc == 2) && ((op & 0xC0) == 0x80);  // STX and LDX index with Y
+  switch ((op >> 2) & 7){
+    case 0:
+      if (cc != 1) return(ref.PC++);             // #immediate
+      zp = refRead(ref.PC++) + ref.X;            // (zp,X)
+      return(refRead(zp) | (refRead((uint8_t)(zp + 1)) << 8));
+    case 1: return(refRead(ref.PC++));           // zp
+    case 2: return(ref.PC++);                    // #immediate
+    case 4:                                      // (zp),Y
+      zp = refRead(ref.PC++);
+      return((refRead(zp) | (refRead((uint8_t)(zp + 1)) << 8)) + ref.Y);
+    case 5: return((uint8_t)(refRead(ref.PC++) + (useY ? ref.Y : ref.X)));  // zp,X
+  }
+  address = refRead(ref.PC) | (refRead(ref.PC + 1) << 8);
+  ref.PC += 2;
+  switch ((op >> 2) & 7){
+    case 3:  return(address);                    // abs
+    case 6:  return(address + ref.Y);            // abs,Y
+    default: return(address + (useY ? ref.Y : ref.X));  // abs,X
+  }
+}
+
+static void refCompare(uint8_t r, uint8_t value){
+  refNZ(r - value);
+  refFlag(CARRY, r >= value);
+}
+
+static void refAdc(uint8_t value){
+  unsigned carry = ref.SR & CARRY, sum = ref.A + value + carry, low, high;
+  refNZ(sum);                              // decimal N V Z : from the binary sum
+  refFlag(OVERFLOW, (ref.A ^ sum) & (value ^ sum) & 0x80);
+  if (ref.SR & DECIMAL){
+    low = (ref.A & 0x0F) + (value & 0x0F) + carry;
+    if (low > 9) low += 6;
+    high = (ref.A >> 4) + (value >> 4) + (low > 0x0F);
+    if (high > 9) high += 6;
+    sum = (high << 4) | (low & 0x0F);
+  }
+  refFlag(CARRY, sum > 0xFF);
+  ref.A = sum;
+}
+
+static void refSbc(uint8_t value){
+  int borrow = !(ref.SR & CARRY), diff = ref.A - value - borrow, low, high;
+  refNZ(diff);
+  refFlag(OVERFLOW, (ref.A ^ value) & (ref.A ^ diff) & 0x80);
+  refFlag(CARRY, diff >= 0);
+  if (ref.SR & DECIMAL){
+    low = (ref.A & 0x0F) - (value & 0x0F) - borrow;
+    high = (ref.A >> 4) - (value >> 4);
+    if (low < 0) { low -= 6; high--; }
+    if (high < 0) high -= 6;
+    diff = (high << 4) | (low & 0x0F);
+  }
+  ref.A = diff;
+}
+
+static uint8_t refShift(uint8_t op, uint8_t value){  // ASL ROL LSR ROR DEC INC
+  uint8_t carry = ref.SR & CARRY;
+  switch (op >> 5){
+    case 0: refFlag(CARRY, value & 0x80); return(refNZ(value << 1));
+    case 1: refFlag(CARRY, value & 0x80); return(refNZ((value << 1) | carry));
+    case 2: refFlag(CARRY, value & 1);    return(refNZ(value >> 1));
+    case 3: refFlag(CARRY, value & 1);    return(refNZ((value >> 1) | (carry << 7)));
+    case 6: return(refNZ(value - 1));
+    default: return(refNZ(value + 1));
+  }
+}
+
+static void refBranch(bool taken){
+  int8_t offset = refRead(ref.PC++);
+  if (taken) ref.PC += offset;
+}
+
+static void refStep(){
+  uint8_t op = refRead(ref.PC++);
+  uint16_t address;
+  switch (op){
+    case 0x00:                                   // BRK
+      ref.PC++;
+      refPush(ref.PC >> 8);
+      refPush(ref.PC);
+      refPush(ref.SR | BREAK | UNDEFINED);
+      ref.SR |= INTERRUPT;
+      ref.PC = refRead(0xFFFE) | (refRead(0xFFFF) << 8);
+      break;
+    case 0x20:                                   // JSR
+      address = refRead(ref.PC) | (refRead(ref.PC + 1) << 8);
+      ref.PC++;
+      refPush(ref.PC >> 8);
+      refPush(ref.PC);
+      ref.PC = address;
+      break;
+    case 0x40:                                   // RTI
+      ref.SR = refPull();
+      ref.PC = refPull();
+      ref.PC |= refPull() << 8;
+      break;
+    case 0x60:                                   // RTS
+      ref.PC = refPull();
+      ref.PC = (ref.PC | (refPull() << 8)) + 1;
+      break;
+    case 0x4C: ref.PC = refAddress(op); break;   // JMP
+    case 0x6C:                                   // JMP (), wraps in the page
+      address = refAddress(op);
+      ref.PC = refRead(address) | (refRead((address & 0xFF00) | ((address + 1) & 0xFF)) << 8);
+      break;
+    case 0x08: refPush(ref.SR | BREAK | UNDEFINED); break;       // PHP
+    case 0x28: ref.SR = refPull() | UNDEFINED; break;            // PLP
+    case 0x48: refPush(ref.A); break;                            // PHA
+    case 0x68: ref.A = refNZ(refPull()); break;                  // PLA
+    case 0x10: refBranch(!(ref.SR & SIGN)); break;               // BPL
+    case 0x30: refBranch(ref.SR & SIGN); break;                  // BMI
+    case 0x50: refBranch(!(ref.SR & OVERFLOW)); break;           // BVC
+    case 0x70: refBranch(ref.SR & OVERFLOW); break;              // BVS
+    case 0x90: refBranch(!(ref.SR & CARRY)); break;              // BCC
+    case 0xB0: refBranch(ref.SR & CARRY); break;                 // BCS
+    case 0xD0: refBranch(!(ref.SR & ZERO)); break;               // BNE
+    case 0xF0: refBranch(ref.SR & ZERO); break;                  // BEQ
+    case 0x18: ref.SR &= ~CARRY; break;                          // CLC
+    case 0x38: ref.SR |= CARRY; break;                           // SEC
+    case 0x58: ref.SR &= ~INTERRUPT; break;                      // CLI
+    case 0x78: ref.SR |= INTERRUPT; break;                       // SEI
+    case 0xB8: ref.SR &= ~OVERFLOW; break;                       // CLV
+    case 0xD8: ref.SR &= ~DECIMAL; break;                        // CLD
+    case 0xF8: ref.SR |= DECIMAL; break;                         // SED
+    case 0x88: refNZ(--ref.Y); break;                            // DEY
+    case 0xC8: refNZ(++ref.Y); break;                            // INY
+    case 0xCA: refNZ(--ref.X); break;                            // DEX
+    case 0xE8: refNZ(++ref.X); break;                            // INX
+    case 0x8A: ref.A = refNZ(ref.X); break;                      // TXA
+    case 0x98: ref.A = refNZ(ref.Y); break;                      // TYA
+    case 0xAA: ref.X = refNZ(ref.A); break;                      // TAX
+    case 0xA8: ref.Y = refNZ(ref.A); break;                      // TAY
+    case 0xBA: ref.X = refNZ(ref.SP); break;                     // TSX
+    case 0x9A: ref.SP = ref.X; break;                            // TXS
+    case 0xEA: break;                                            // NOP
+    case 0x0A: case 0x2A: case 0x4A: case 0x6A:                  // shifts on A
+      ref.A = refShift(op, ref.A);
+      break;
+    case 0x06: case 0x0E: case 0x16: case 0x1E:                  // ASL
+    case 0x26: case 0x2E: case 0x36: case 0x3E:                  // ROL
+    case 0x46: case 0x4E: case 0x56: case 0x5E:                  // LSR
+    case 0x66: case 0x6E: case 0x76: case 0x7E:                  // ROR
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE:                  // DEC
+    case 0xE6: case 0xEE: case 0xF6: case 0xFE:                  // INC
+      address = refAddress(op);
+      refWrite(address, refShift(op, refRead(address)));
+      break;
+    case 0x01: case 0x05: case 0x09: case 0x0D:                  // ORA
+    case 0x11: case 0x15: case 0x19: case 0x1D:
+      ref.A = refNZ(ref.A | refRead(refAddress(op)));
+      break;
+    case 0x21: case 0x25: case 0x29: case 0x2D:                  // AND
+    case 0x31: case 0x35: case 0x39: case 0x3D:
+      ref.A = refNZ(ref.A & refRead(refAddress(op)));
+      break;
+    case 0x41: case 0x45: case 0x49: case 0x4D:                  // EOR
+    case 0x51: case 0x55: case 0x59: case 0x5D:
+      ref.A = refNZ(ref.A ^ refRead(refAddress(op)));
+      break;
+    case 0x61: case 0x65: case 0x69: case 0x6D:                  // ADC
+    case 0x71: case 0x75: case 0x79: case 0x7D:
+      refAdc(refRead(refAddress(op)));
+      break;
+    case 0xE1: case 0xE5: case 0xE9: case 0xED:                  // SBC
+    case 0xF1: case 0xF5: case 0xF9: case 0xFD:
+      refSbc(refRead(refAddress(op)));
+      break;
+    case 0xC1: case 0xC5: case 0xC9: case 0xCD:                  // CMP
+    case 0xD1: case 0xD5: case 0xD9: case 0xDD:
+      refCompare(ref.A, refRead(refAddress(op)));
+      break;
+    case 0xE0: case 0xE4: case 0xEC:                             // CPX
+      refCompare(ref.X, refRead(refAddress(op)));
+      break;
+    case 0xC0: case 0xC4: case 0xCC:                             // CPY
+      refCompare(ref.Y, refRead(refAddress(op)));
+      break;
+    case 0xA1: case 0xA5: case 0xA9: case 0xAD:                  // LDA
+    case 0xB1: case 0xB5: case 0xB9: case 0xBD:
+      ref.A = refNZ(refRead(refAddress(op)));
+      break;
+    case 0xA2: case 0xA6: case 0xAE: case 0xB6: case 0xBE:       // LDX
+      ref.X = refNZ(refRead(refAddress(op)));
+      break;
+    case 0xA0: case 0xA4: case 0xAC: case 0xB4: case 0xBC:       // LDY
+      ref.Y = refNZ(refRead(refAddress(op)));
+      break;
+    case 0x81: case 0x85: case 0x8D:                             // STA
+    case 0x91: case 0x95: case 0x99: case 0x9D:
+      refWrite(refAddress(op), ref.A);
+      break;
+    case 0x86: case 0x8E: case 0x96:                             // STX
+      refWrite(refAddress(op), ref.X);
+      break;
+    case 0x84: case 0x8C: case 0x94:                             // STY
+      refWrite(refAddress(op), ref.Y);
+      break;
+    case 0x24: case 0x2C:                                        // BIT
+      address = refRead(refAddress(op));
+      refFlag(ZERO, !(ref.A & address));
+      ref.SR = (ref.SR & ~(SIGN | OVERFLOW)) | (address & (SIGN | OVERFLOW));
+      break;
+    default: break;                    // undefined opcodes are 1 byte NOPs
+  }
+}
+
+static void lockstepCheck(uint16_t pc){  // run the reference over the same step
+  history[historyCount++ % 16] = pc;
+  ioNext = refWriteCount = 0;
+  refStep();
+  if (ref.PC != reg.PC || ref.A != reg.A || ref.X != reg.X || ref.Y != reg.Y
+      || ref.SP != reg.SP || ((ref.SR ^ reg.SR) & ~(BREAK | UNDEFINED)))
+    lockstepFail("registers");
+  if (refWriteCount != writeCount) lockstepFail("memory writes");
+  for (int i=0; i<writeCount; i++)
+    if (refWrites[i].address != writes[i].address || refWrites[i].value != writes[i].value)
+      lockstepFail("memory writes");
+  ioCount = writeCount = 0;
+}
+
+// GUEST CODE COVERAGE
+
+// Built with make coverage only, so the normal core pays nothing. Each
+// executed address is set in a 64K bitmap, each branch site records if it
+// was taken and not taken, in memory shared with the workers of -B and -e.
+// On exit an lcov tracefile is written (-c FILE)
+// using the addresses as line numbers. An assembler listing (-s FILE) adds
+// the code lines never executed and the symbols, as functions :
+//   0800: A9 00 ...   a line of code at $0800
+//   START EQU $0800   or START = $0800, a symbol
+// The symbols also name the routines of the GUEST PROFILE, in any build.
+
+struct Symbol{
+  uint16_t address;
+  char name[32];
+}*symbols = NULL;
+
+int symbolCount = 0;
+
+#ifdef COVERAGE
+
+#define TESTBIT(map, address) (map[(address) >> 3] & (1 << ((address) & 7)))
+#define SETBIT(map, address) (map[(address) >> 3] |= 1 << ((address) & 7))
+
+uint8_t *executed, *taken, *notTaken;  // shared, see startCoverage
+uint8_t listed[0x2000];
+
+#endif
+
+static void readListing(const char *filename){
+  char line[256], name[32], equ[8], *bytes;
+  unsigned address;
+  int n;
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) return;
+  while (fgets(line, sizeof(line), f)){
+    bytes = line + 4 + (line[4] == ':');
+    while (*bytes == ' ' || *bytes == '\t') bytes++;
+    if (sscanf(line, "%4x%n", &address, &n) == 1 && n == 4
+        && isxdigit(bytes[0]) && isxdigit(bytes[1]) && isspace(bytes[2])){
+#ifdef COVERAGE
+      SETBIT(listed, address);
+#endif
+    }
+    else if (sscanf(line, "%31s %7s $%x", name, equ, &address) == 3
+        && (!strcmp(equ, "=") || !strcasecmp(equ, "EQU"))){
+      symbols = realloc(symbols, (symbolCount + 1) * sizeof(struct Symbol));
+      symbols[symbolCount].address = address;
+      strcpy(symbols[symbolCount++].name, name);
+    }
+  }
+  fclose(f);
+}
+
+#ifdef COVERAGE
+
+static void shareBit(uint8_t *map, uint16_t address){  // SETBIT, across processes
+  if (!TESTBIT(map, address))
+    __atomic_fetch_or(&map[address >> 3], 1 << (address & 7), __ATOMIC_RELAXED);
+}
+
+static void startCoverage(){
+  executed = mmap(NULL, 3 * 0x2000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (executed == MAP_FAILED) executed = calloc(3, 0x2000);  // for this process only
+  taken = executed + 0x2000;
+  notTaken = taken + 0x2000;
+}
+
+static void cover(uint16_t pc, uint8_t opcode){
+  shareBit(executed, pc);
+  if (addressing[opcode] == REL){
+    if (reg.PC == ((pc + 2) & 0xFFFF)) shareBit(notTaken, pc);
+    else shareBit(taken, pc);
+  }
+}
+
+static void writeCoverage(const char *filename){
+  int lines = 0, hit = 0, branches = 0, branchesHit = 0, functionsHit = 0;
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) return;
+  fprintf(f, "TN:\nSF:guest\n");
+  for (int i=0; i<symbolCount; i++)
+    fprintf(f, "FN:%d,%s\n", symbols[i].address, symbols[i].name);
+  for (int i=0; i<symbolCount; i++){
+    fprintf(f, "FNDA:%d,%s\n", TESTBIT(executed, symbols[i].address) ? 1 : 0, symbols[i].name);
+    if (TESTBIT(executed, symbols[i].address)) functionsHit++;
+  }
+  fprintf(f, "FNF:%d\nFNH:%d\n", symbolCount, functionsHit);
+  for (int address=0; address<0x10000; address++){
+    if (!TESTBIT(executed, address) && !TESTBIT(listed, address)) continue;
+    fprintf(f, "DA:%d,%d\n", address, TESTBIT(executed, address) ? 1 : 0);
+    lines++;
+    if (TESTBIT(executed, address)) hit++;
+    if (!TESTBIT(taken, address) && !TESTBIT(notTaken, address)) continue;
+    fprintf(f, "BRDA:%d,0,0,%s\n", address, TESTBIT(taken, address) ? "1" : "0");
+    fprintf(f, "BRDA:%d,0,1,%s\n", address, TESTBIT(notTaken, address) ? "1" : "0");
+    branches += 2;
+    branchesHit += (TESTBIT(taken, address) ? 1 : 0) + (TESTBIT(notTaken, address) ? 1 : 0);
+  }
+  fprintf(f, "BRF:%d\nBRH:%d\nLF:%d\nLH:%d\nend_of_record\n",
+    branches, branchesHit, lines, hit);
+  fclose(f);
+}
+
+#endif
+
+// NATIVE ROM ROUTINES
+
+// The busiest ROM loops are run natively : the Monitor MOVE and VERIFY, the
+// hi-res fill and line of the Programmer's Aid and of Applesoft (HGR, HGR2,
+// HPLOT TO). When the PC reaches the head of
+// one, all its passes but the last are done at once, leaving memory,
+// registers and cycle count as the 6502 code would, and the core runs the
+// last pass, which leaves the loop as usual. The ROM bytes they stand for
+// are checked at start. The loops are interpreted with -n, -l and -w, and
+// while replaying, so that reverse execution can stop on any instruction,
+// and in the coverage build.
+
+enum { N_MOVE, N_VERIFY, N_FILL, N_LINE };
+
+struct Native{
+  uint16_t pc;                  // head of the loop
+  uint8_t kind;
+  uint16_t code[4];             // two ranges of ROM it runs
+  uint32_t hash;                // of these ranges
+  uint8_t zp;                   // N_LINE : DX, DY, QDRNT and E from there
+  uint16_t horiz, hbase;        // N_LINE : column of the pen, screen page
+}nativeRoutines[] = {
+  {0xFE2C, N_MOVE,   {0xFE2C, 0xFE35, 0xFCB4, 0xFCC8}, 0x367C2A30},
+  {0xFE36, N_VERIFY, {0xFE36, 0xFE5B, 0xFCB4, 0xFCC8}, 0x68BB1180},
+  {0xD01B, N_FILL,   {0xD01B, 0xD02D, 0xD0A2, 0xD0AD}, 0xF453968D},
+  {0xD1BE, N_LINE,   {0xD1AD, 0xD1E2, 0xD088, 0xD156}, 0xC187625F, 0x50, 0x0325, 0x0326},
+  {0xF3FE, N_FILL,   {0xF3FE, 0xF410, 0xF47E, 0xF489}, 0xEB6DC57D},  // Applesoft
+  {0xF58D, N_LINE,   {0xF57C, 0xF5B1, 0xF465, 0xF52F}, 0xFAD268E8, 0xD0, 0x00E5, 0x00E6},
+};
+
+#define NATIVES (sizeof(nativeRoutines) / sizeof(struct Native))
+
+#ifdef __linux__                // their host code in one section, see GUEST PROFILE
+#define NATIVECODE __attribute__((section("nativecode")))
+extern char __stop_nativecode[];            // end of the section
+#else
+#define NATIVECODE
+#endif
+
+bool natives = true;          // -n to interpret everything
+uint8_t nativeHead[0x2000];   // bitmap of the loop heads found in the ROM
+
+static uint32_t romHash(const uint16_t *code){  // FNV-1a of the two ranges
+  uint32_t hash = 2166136261u;
+  for (int r=0; r<4; r+=2)
+    hash = fnv(hash, rom + code[r] - ROMSTART, code[r+1] - code[r] + 1);
+  return(hash);
+}
+
+static void findNatives(){
+  memset(nativeHead, 0, sizeof(nativeHead));
+  if (!natives || lockstep || watch >= 0) return;
+#ifdef COVERAGE
+  return;                                        // their ROM lines are covered
+#endif
+  for (int n=0; n<NATIVES; n++)
+    if (romHash(nativeRoutines[n].code) == nativeRoutines[n].hash)
+      nativeHead[nativeRoutines[n].pc >> 3] |= 1 << (nativeRoutines[n].pc & 7);
+}
+
+static uint8_t nz(uint8_t value){
+  return((value & SIGN) | (value ? 0 : ZERO));
+}
+
+static void handOff(uint16_t pc, uint8_t a, uint8_t flags){  // N, Z, C and V
+  reg.PC = pc;                    // the state at an instruction of the loop
+  reg.A = a;
+  reg.SR = (reg.SR & ~(SIGN | ZERO | CARRY | OVERFLOW)) | flags;
+}
+
+static uint8_t adc(uint8_t a, uint8_t b, uint8_t *carry){  // binary ADC
+  uint16_t sum = a + b + *carry;
+  *carry = sum >> 8;
+  return(sum);
+}
+
+static uint16_t zpWord(uint8_t address){
+  return(readMem(address) | readMem((uint8_t)(address + 1)) << 8);
+}
+
+// MOVE ($FE2C) and VERIFY ($FE36) copy or compare A1-A2 to A4, +Y, and call
+// NXTA4 for each byte : 54 and 56 cycles, 4 more when A1L or A4L wraps. A
+// copy is forward, byte by byte, so an overlap repeats bytes as it does on
+// the 6502. VERIFY stops before a difference, which the ROM prints.
+
+NATIVECODE static void nativeMove(bool verify){
+  uint16_t a1 = zpWord(0x3C), a2 = zpWord(0x3E), a4 = zpWord(0x42);
+  uint16_t from = a1 + reg.Y, to = a4 + reg.Y;
+  uint32_t passes = a1 < a2 ? a2 - a1 : 0;  // all but the last
+  uint8_t carry, high, overflow;
+  if (from + passes > RAMSIZE || to + passes > RAMSIZE  // no I/O, and not the
+      || from < 0x200 || to < 0x200) passes = 0;          // pointers or stack
+  if (verify){
+    for (uint32_t i=0; i<passes; i++)
+      if (readMem(from + i) != readMem(to + i)) passes = i;
+  }
+  else for (uint32_t i=0; i<passes; i++)
+    writeMem(to + i, readMem(from + i));
+  if (!passes) return;
+  ticks += passes * (verify ? 56 : 54)
+    + 4 * (((a1 & 0xFF) + passes) >> 8) + 4 * (((a4 & 0xFF) + passes) >> 8);
+  a1 += passes - 1;                         // NXTA1 of the last pass done
+  carry = (a1 & 0xFF) >= (a2 & 0xFF);       // CMP A2L, LDA A1H, SBC A2H
+  high = adc(a1 >> 8, ~a2 >> 8, &carry);
+  overflow = ((a1 >> 8) ^ (a2 >> 8)) & ((a1 >> 8) ^ high) & 0x80 ? OVERFLOW : 0;
+  a1++;                                     // INC A1L, and A1H as it wraps
+  handOff(reg.PC, high, carry | overflow | nz(a1 & 0xFF ? a1 : a1 >> 8));
+  a4 += passes;
+  writeMem(0x3C, a1); writeMem(0x3D, a1 >> 8);
+  writeMem(0x42, a4); writeMem(0x43, a4 >> 8);
+}
+
+static void touch(uint16_t first, uint32_t count){  // dirty rows, at once
+  if (first < 0x0C00 && first + count > 0x0400) dirtyRows[0] = dirtyRows[1] = ALLROWS;
+  if (first < 0x6000 && first + count > 0x2000) dirtyRows[0] = dirtyRows[1] = ALLROWS;
+}
+
+// The hi-res fill (HGR, HGR2, BKGND) stores HCOLOR1 at ($1A),Y, Y then $1B
+// going up to the end of the screen page, and shifts the color at each
+// byte : 33 cycles, one more if the BNE back crosses a page (Applesoft),
+// 7 more for the shift, 12 more for a new page. A color
+// shifts at every byte or never, so this is a memset, or two bytes
+// repeated.
+
+NATIVECODE static void nativeFill(){
+  uint8_t y = reg.Y, page = readMem(0x1B), color = readMem(0x1C), other, last, shifted, a;
+  uint16_t start = (page << 8 | readMem(0x1A)) + y;
+  uint32_t passes = (0x20 - (page & 0x1F)) * 256 - y - 1;  // all but the last
+  uint32_t end = start + passes, next;
+  bool shifts = (uint8_t)((uint8_t)(color << 1) - 0xC0) & 0x80;
+  int cycles = 33 + (((reg.PC + 10) ^ reg.PC) & 0xFF00 ? 1 : 0) + (shifts ? 7 : 0);
+  if (!passes || start < 0x200 || end > RAMSIZE) return;  // not its pointer
+  other = shifts ? color ^ 0x7F : color;
+  for (uint32_t address=start; address<end; address=next){
+    uint8_t *bank = ram + writeOffset[address >> 8];
+    next = (address | 0xFF) + 1 < end ? (address | 0xFF) + 1 : end;
+    stale(address);
+    written[(address + writeOffset[address >> 8]) >> 8] = WRITTEN;
+    if (!shifts) memset(bank + address, color, next - address);
+    else for (uint32_t i=address; i<next; i++) bank[i] = (i - start) & 1 ? other : color;
+  }
+  touch(start, passes);
+  ticks += passes * cycles + 12 * ((y + passes) >> 8);
+  last = (passes - 1) & 1 ? other : color;      // at the last pass done
+  shifted = last << 1;
+  a = shifts ? last ^ 0x7F : shifted;
+  page += (y + passes) >> 8;
+  y += passes;
+  if (!y) a = page & 0x1F;                      // INY, or AND #$1F
+  reg.Y = y;
+  handOff(reg.PC, a, (shifted >= 0xC0 ? CARRY : 0) | nz(y ? y : a) | (reg.SR & OVERFLOW));
+  writeMem(0x1B, page);
+  writeMem(0x1C, passes & 1 ? other : color);
+}
+
+// The hi-res line of the Programmer's Aid (LINE) is the HGLIN of Applesoft
+// (HPLOT TO) with its variables moved. The pass at the plot ($D1BE, $F58D)
+// draws a point with the mask, counts down, then steps the pen across
+// (HMOVE) or up or down (VMOVE) and adds to the error term. The moves are
+// transcribed instruction by instruction, with their cycles.
+
+struct Pen{
+  uint8_t y, gbasl, gbash, hmask, color, horiz;
+};
+
+NATIVECODE static int hmove(const struct Native *n, struct Pen *p, uint8_t qdrnt){
+  int cycles = 6 + 6 + 3;                         // JSR, RTS, STA HMASK
+  uint8_t a;
+  if (!(qdrnt & 0x40)){                           // right
+    cycles += 3 + 3 + 2 + 2;
+    a = (uint8_t)(p->hmask << 1) ^ 0x80;
+    if (a & 0x80){ p->hmask = a; return(cycles + 3); }  // in the same byte
+    cycles += 2 + 2 + 2 + 2;
+    a = 0x81;
+    if (++p->y < 0x28) cycles += 3;
+    else { p->y = 0; cycles += 2 + 2 + 3; }
+  } else {                                        // left
+    cycles += 2 + 3 + 2;
+    if (!(p->hmask & 1)){ p->hmask = (p->hmask >> 1) ^ 0xC0; return(cycles + 2 + 2); }
+    cycles += 3 + 2;
+    if (--p->y & 0x80){ p->y = 0x27; cycles += 2 + 2; }
+    else cycles += 3;
+    a = 0xC0;
+    cycles += 2;
+  }
+  p->hmask = a;                                   // a new byte, the color
+  p->horiz = p->y;                                // shifts for odd columns
+  cycles += (n->horiz < 0x100 ? 3 : 4) + 3 + 2 + 2;
+  if ((uint8_t)((uint8_t)(p->color << 1) - 0xC0) & 0x80){ p->color ^= 0x7F; cycles += 2 + 3 + 2 + 3; }
+  else cycles += 3;
+  return(cycles);
+}
+
+NATIVECODE static int vmove(const struct Native *n, struct Pen *p, uint8_t qdrnt,
+                 uint8_t hbase, int *pushed){         // -1 if it falls through
+  int cycles = 6 + 6;
+  uint8_t a, t, carry = 0, out;
+  if (!(qdrnt & 0x80)){                           // down
+    cycles += 2 + 2 + 3 + 4;
+    a = p->gbash;
+    if (a & 0x1C) cycles += 3;                    // in the same group of 8
+    else {
+      cycles += 2 + 5;
+      carry = p->gbasl >> 7;
+      p->gbasl <<= 1;
+      if (carry) cycles += 3;
+      else {
+        cycles += 2 + 4;
+        if (a & 0x03){
+          cycles += 2 + 2 + 2 + 3;
+          a = adc(a, 0x1F, &carry);
+          carry = 1;
+          goto down;
+        }
+        cycles += 3 + 2 + 3 + 3 + 2;
+        a = adc(a, 0x23, &carry);
+        *pushed = a;                              // PHA
+        t = adc(p->gbasl, 0xB0, &carry);
+        if (carry) cycles += 3;
+        else { cycles += 2 + 2; t = adc(t, 0xF0, &carry); }
+        p->gbasl = t;
+        cycles += 3 + 4;                          // PLA
+        if (carry){ cycles += 3; goto down; }
+        cycles += 2;
+      }
+      cycles += 2;
+      a = adc(a, 0x1F, &carry);
+      down:
+      cycles += 5;                                // ROR GBASL
+      out = p->gbasl & 1;
+      p->gbasl = p->gbasl >> 1 | carry << 7;
+      carry = out;
+    }
+    cycles += 2;
+    a = adc(a, 0xFC, &carry);
+  } else {                                        // up
+    cycles += 4 + 3 + 2 + 4;                      // BMI to another page
+    a = adc(p->gbash, 0x04, &carry);
+    if (a & 0x1C) cycles += 3;
+    else {
+      cycles += 2 + 5;
+      carry = p->gbasl >> 7;
+      p->gbasl <<= 1;
+      if (!carry) cycles += 3;
+      else {
+        cycles += 2 + 2 + 2 + 4;
+        a = adc(a, 0xE0, &carry);
+        carry = 0;
+        if (!(a & 0x04)){ cycles += 3; goto up; }
+        cycles += 2 + 3 + 2 + 2;
+        t = adc(p->gbasl, 0x50, &carry) ^ 0xF0;
+        if (!t) cycles += 3;
+        else { cycles += 2 + 2; t ^= 0xF0; }
+        p->gbasl = t;
+        cycles += 3 + (n->hbase < 0x100 ? 3 : 4);
+        a = hbase;
+        if (!carry){ cycles += 3; goto up; }
+        cycles += 2;
+      }
+      cycles += 2;
+      a = adc(a, 0xE0, &carry);
+      up:
+      cycles += 5;                                // ROR GBASL
+      out = p->gbasl & 1;
+      p->gbasl = p->gbasl >> 1 | carry << 7;
+      if (out) return(-1);                        // into the line entry
+      cycles += 3;
+    }
+  }
+  cycles += 3;                                    // STA GBASH
+  p->gbash = a;
+  return(cycles);
+}
+
+NATIVECODE static void nativeLine(const struct Native *n){
+  struct Pen p, moved;
+  uint8_t x = reg.X, count = readMem(0x1D), sp = reg.SP;
+  uint8_t dxl = readMem(n->zp), dxh = readMem(n->zp + 1), dy = readMem(n->zp + 2);
+  uint8_t qdrnt = readMem(n->zp + 3), el = readMem(n->zp + 4), eh = readMem(n->zp + 5);
+  uint8_t hbase = readMem(n->hbase), carry = reg.SR & CARRY, overflow = reg.SR & OVERFLOW;
+  uint8_t b, high = 0;
+  uint16_t pc = n->pc, called = 0;
+  uint32_t rows[2] = {0, 0};
+  int cycles, moveCycles, pushed = -1;
+  bool done = false;
+  if (reg.SR & DECIMAL) return;
+  p = (struct Pen){reg.Y, readMem(0x26), readMem(0x27), readMem(0x30), readMem(0x1C), readMem(n->horiz)};
+  while ((count << 8 | x) != 0xFFFF){             // the last pass ends it
+    uint16_t address = (p.gbash << 8 | p.gbasl) + p.y;
+    if ((uint16_t)(address - 0x400) >= RAMSIZE - 0x400) break;
+    b = ram[address + readOffset[address >> 8]];  // plot
+    ram[address + writeOffset[address >> 8]] = ((b ^ p.color) & p.hmask) ^ b;
+    stale(address);
+    written[(address + writeOffset[address >> 8]) >> 8] = WRITTEN;
+    rows[writeOffset[address >> 8] != 0] |= rowBit(address);
+    cycles = 22 + 2 + 3 + 3;
+    if (!++x){ count++; cycles += 6; }
+    if (carry){                                   // across
+      cycles += 3 + 2 + hmove(n, &p, qdrnt) + 19;
+      called = n->pc - 14;
+      carry = 1;                                  // E += DY, then the borrow
+      el = adc(el, dy, &carry);
+      high = adc(eh, 0xFF, &carry);
+      overflow = eh & (eh ^ high) & 0x80 ? OVERFLOW : 0;
+      eh = high;
+    } else {                                      // up or down
+      moved = p;
+      moveCycles = vmove(n, &moved, qdrnt, hbase, &pushed);
+      cycles += 2;
+      if (moveCycles < 0){                        // at the JSR, for the core
+        ticks += cycles;
+        pc = n->pc + 0x15;
+        done = true;
+        break;
+      }
+      p = moved;
+      cycles += moveCycles + 17;
+      called = n->pc + 0x17;
+      carry = 0;                                  // E += DX
+      el = adc(el, dxl, &carry);
+      high = adc(eh, dxh, &carry);
+      overflow = ~(eh ^ dxh) & (eh ^ high) & 0x80 ? OVERFLOW : 0;
+      if (overflow){                              // at the BVC, for the core
+        ticks += cycles;
+        pc = n->pc + 0x23;
+        done = true;
+        break;
+      }
+      cycles += 3 + 3;
+      eh = high;
+    }
+    ticks += cycles;
+    done = true;
+  }
+  if (!done) return;
+  dirtyRows[0] |= rows[0];
+  dirtyRows[1] |= rows[1];
+  if (pc == n->pc) handOff(pc, eh, nz(eh) | carry | overflow);
+  else if (pc == n->pc + 0x15) handOff(pc, qdrnt, nz(qdrnt) | overflow);
+  else handOff(pc, high, nz(high) | carry | overflow);
+  reg.X = x;
+  reg.Y = p.y;
+  writeMem(0x1D, count);
+  writeMem(0x26, p.gbasl); writeMem(0x27, p.gbash);
+  writeMem(0x30, p.hmask); writeMem(0x1C, p.color);
+  writeMem(n->horiz, p.horiz);
+  writeMem(n->zp + 4, el); writeMem(n->zp + 5, eh);
+  if (called){                                    // what the JSRs and PHA left
+    writeMem(0x100 + sp, called >> 8);
+    writeMem(0x100 + (uint8_t)(sp - 1), called);
+  }
+  if (pushed >= 0) writeMem(0x100 + (uint8_t)(sp - 2), pushed);
+}
+
+static void native(){                 // at a loop head, see NATIVE ROM ROUTINES
+  if (!natives) return;
+  for (int n=0; n<NATIVES; n++)
+    if (nativeRoutines[n].pc == reg.PC) switch (nativeRoutines[n].kind){
+      case N_MOVE:   nativeMove(false); return;
+      case N_VERIFY: nativeMove(true);  return;
+      case N_FILL:   nativeFill();      return;
+      case N_LINE:   nativeLine(&nativeRoutines[n]); return;
+    }
+}
+
+
+// GUEST PROFILE
+
+// -g FILE writes where the guest spends its cycles, as folded stacks for
+// flamegraph.pl : one line per call stack, "guest:$FD0C RDKEY;guest:$FD1B
+// KEYIN 123456". Every SAMPLECYCLES the cycles since the last sample are
+// charged to the stack of the machine shown, read back from page one : a
+// pair that returns after a JSR is a frame, named after its target. The
+// routine holding the first JSR starts the stack, the one holding the PC
+// ends it when it is not the last called. The routines are the Monitor
+// entry points below and the symbols of -s LISTING, or a bare address.
+// The decoded blocks are data, but the natives are host code standing for
+// guest routines : -g also writes /tmp/perf-PID.map, which names their C
+// functions after these routines, "guest:$FE2C MOVE,guest:$FE36 VERIFY",
+// their extents taken from the section holding them. The code is left where
+// it is : perf names it from the ELF symbols, the map is for the tools that
+// read it whatever the mapping.
+
+#define SAMPLECYCLES 9973          // prime, not to beat with a loop
+#define STACKS       4096          // distinct stacks, a power of 2
+
+static const struct Symbol monitorSymbols[] = {
+  {0xF800, "PLOT"},   {0xF819, "HLINE"},  {0xF828, "VLINE"},  {0xF832, "CLRSCR"},
+  {0xF836, "CLRTOP"}, {0xF871, "SCRN"},   {0xF941, "PRNTAX"}, {0xF948, "PRBLNK"},
+  {0xFA62, "RESET"},  {0xFB1E, "PREAD"},  {0xFB2F, "INIT"},   {0xFB39, "SETTXT"},
+  {0xFB40, "SETGR"},  {0xFBC1, "BASCALC"},{0xFBF4, "ADVANCE"},{0xFBFD, "VIDOUT"},
+  {0xFC22, "VTAB"},   {0xFC24, "VTABZ"},  {0xFC42, "CLREOP"}, {0xFC58, "HOME"},
+  {0xFC62, "CR"},     {0xFC66, "LF"},     {0xFC70, "SCROLL"}, {0xFC9C, "CLREOL"},
+  {0xFCA8, "WAIT"},   {0xFCB4, "NXTA4"},  {0xFCBA, "NXTA1"},  {0xFD0C, "RDKEY"},
+  {0xFD1B, "KEYIN"},  {0xFD35, "RDCHAR"}, {0xFD67, "GETLNZ"}, {0xFD6A, "GETLN"},
+  {0xFD8B, "CROUT1"}, {0xFD8E, "CROUT"},  {0xFDDA, "PRBYTE"}, {0xFDE3, "PRHEX"},
+  {0xFDED, "COUT"},   {0xFDF0, "COUT1"},  {0xFE2C, "MOVE"},   {0xFE36, "VERIFY"},
+  {0xFF2D, "PRERR"},  {0xFF3A, "BELL"},   {0xFF3F, "RESTORE"},{0xFF4A, "SAVE"},
+  {0xFF59, "OLDRST"}, {0xFF65, "MON"},    {0xFF69, "MONZ"}
+};
+
+struct Stack{
+  char *folded;
+  uint64_t cycles;
+}stacks[STACKS];                   // by hash
+
+int stackCount = 0;
+uint64_t sampleDue = UINT64_MAX, lastSample = 0;
+
+static const struct Symbol *routine(uint16_t address, bool exact){
+  const struct Symbol *best = NULL;
+  int count = sizeof(monitorSymbols) / sizeof(monitorSymbols[0]);
+  for (int i=0; i<symbolCount + count; i++){       // the listing first
+    const struct Symbol *s = i < symbolCount ? &symbols[i] : &monitorSymbols[i - symbolCount];
+    if (s->address == address) return(s);
+    if (!exact && s->address < address && address - s->address < 0x400
+        && (!best || s->address > best->address)) best = s;
+  }
+  return(best);
+}
+
+static int frame(char *out, uint16_t address, const struct Symbol *s){
+  if (s) return(sprintf(out, "guest:$%04X %s", s->address, s->name));
+  return(sprintf(out, "guest:$%04X", address));
+}
+
+static void sample(){
+  uint16_t called[64], site = reg.PC;
+  int depth = 0, length = 0;
+  char folded[66 * 48];
+  const struct Symbol *s;
+  if (ticks > lastSample){
+    for (int i=reg.SP + 1; i<0xFF && depth<64; i++){  // return addresses, newest first
+      uint16_t back = (peek(0x100 + i) | peek(0x100 + i + 1) << 8) - 2;
+      if (peek(back) != 0x20) continue;                // not after a JSR
+      called[depth++] = peek(back + 1) | peek(back + 2) << 8;
+      site = back;
+      i++;
+    }
+    if (depth && (s = routine(site, false)))            // the first caller
+      length += frame(folded + length, s->address, s), folded[length++] = ';';
+    for (int d=depth-1; d>=0; d--){                    // root first
+      length += frame(folded + length, called[d], routine(called[d], true));
+      folded[length++] = ';';
+    }
+    s = routine(reg.PC, false);
+    if (depth && (!s || s->address <= called[0])) length--;  // in the last one called
+    else length += frame(folded + length, reg.PC & (s ? 0xFFFF : 0xFF00), s);
+    folded[length] = 0;
+    uint32_t slot = fnv(2166136261u, (uint8_t *)folded, length) % STACKS;
+    while (stacks[slot].folded && strcmp(stacks[slot].folded, folded)) slot = (slot + 1) % STACKS;
+    if (stacks[slot].folded || stackCount < STACKS * 3 / 4){
+      if (!stacks[slot].folded){ stacks[slot].folded = strdup(folded); stackCount++; }
+      stacks[slot].cycles += ticks - lastSample;
+    }
+  }
+  lastSample = ticks;                                  // or gone back in time
+  sampleDue = ticks + SAMPLECYCLES;
+}
+
+static void writeGuestProfile(const char *filename){
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) return;
+  for (int slot=0; slot<STACKS; slot++)
+    if (stacks[slot].folded)
+      fprintf(f, "%s %llu\n", stacks[slot].folded, (unsigned long long)stacks[slot].cycles);
+  fclose(f);
+}
+
+static void writePerfMap(){
+#ifdef __linux__
+  struct { uintptr_t start; uint8_t kind; } code[] = {
+    {(uintptr_t)nativeMove, N_MOVE}, {(uintptr_t)nativeFill, N_FILL},
+    {(uintptr_t)hmove, N_LINE}, {(uintptr_t)vmove, N_LINE}, {(uintptr_t)nativeLine, N_LINE}};
+  int count = sizeof(code) / sizeof(code[0]);
+  char filename[32], name[4 * 48];
+  for (int i=1; i<count; i++)                    // by address
+    for (int j=i; j>0 && code[j].start < code[j-1].start; j--){
+      uintptr_t start = code[j].start; uint8_t kind = code[j].kind;
+      code[j] = code[j-1]; code[j-1].start = start; code[j-1].kind = kind;
+    }
+  sprintf(filename, "/tmp/perf-%d.map", getpid());
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) return;
+  for (int i=0; i<count; i++){
+    uintptr_t end = i + 1 < count ? code[i+1].start : (uintptr_t)__stop_nativecode;
+    int length = 0;
+    for (int n=0; n<NATIVES; n++){               // the routines it runs in this ROM
+      uint16_t pc = nativeRoutines[n].pc;
+      uint8_t kind = nativeRoutines[n].kind == N_VERIFY ? N_MOVE : nativeRoutines[n].kind;
+      if (kind != code[i].kind || !(nativeHead[pc >> 3] & 1 << (pc & 7))) continue;
+      if (length) name[length++] = ',';
+      length += frame(name + length, pc, routine(pc, true));
+    }
+    if (length) fprintf(f, "%lx %lx %s\n", (unsigned long)code[i].start,
+      (unsigned long)(end - code[i].start), name);
+  }
+  fclose(f);
+#endif
+}
+
+
+static void step(){                // run one instruction
+  if (nativeHead[reg.PC >> 3] & 1 << (reg.PC & 7)) native();
+  uint16_t pc = opcodePC = reg.PC;
+  uint8_t opcode;
+  const struct Decoded *block = pc >= ROMSTART ?
+    atomic_load_explicit(&blocks[(pc - ROMSTART) >> 8], memory_order_acquire)
+    : pc < RAMSIZE ? tier->blocks[pc >> 8] : NULL;
+  if (block){                         // decoded : no fetch
+    const struct Decoded *decoded = &block[pc & 0xFF];
+    opcode = decoded->opcode;
+    operand = decoded->operand;
+    reg.PC++;
+    decodedModes[decoded->mode]();
+  }
+  else {
+    opcode = readMem(reg.PC++);       // FETCH and increment the Program Counter
+    addressing[opcode]();             // DECODE operands against the addressing mode
+    if (pc >= ROMSTART || pc < RAMSIZE) warm(pc);
+  }
+  instruction[opcode]();              // EXECUTE the instruction
+  ticks += cycles[opcode];
+  if (lockstep) lockstepCheck(pc);
+#ifdef COVERAGE
+  cover(pc, opcode);
+#endif
+}
+
+
+// SNAPSHOTS AND REVERSE EXECUTION
+
+// A snapshot of the machine is taken every SNAPINTERVAL cycles and every
+// input is logged with the cycle it was delivered at. Going back in time is
+// restoring the nearest earlier snapshot and replaying the log up to the
+// target cycle, at full speed : ~1ms per million cycles.
+
+struct Snapshot{
+  uint64_t ticks;
+  struct Register reg;
+  uint8_t key;
+  size_t typedNext;
+  uint8_t paddles[4], buttons;
+  uint64_t paddleTrigger;
+  uint8_t video, banks;
+  uint32_t mapBank;
+  uint8_t ram[2 * RAMSIZE];
+}snapshots[SNAPSLOTS];
+
+int snapFirst = 0, snapCount = 0;  // ring of snapshots, oldest first
+
+enum { EV_RESET, EV_PADDLE0, EV_PADDLE1, EV_PADDLE2, EV_PADDLE3, EV_BUTTONS };
+                                   // input types, keys are in typed[]
+
+struct Event{
+  uint64_t ticks;
+  uint8_t type, value;
+}*events = NULL;
+
+size_t eventCount = 0, eventSize = 0;
+
+static struct Snapshot *snapshot(int n){  // n-th oldest snapshot
+  return(&snapshots[(snapFirst + n) % SNAPSLOTS]);
+}
+
+static void storeSnapshot(const struct Snapshot *s);
+FILE *pagesFile = NULL, *snapsFile = NULL;  // -S, see SNAPSHOT STORE
+
+static void saveState(struct Snapshot *s){
+  s->ticks = ticks;
+  s->reg = reg;
+  s->key = key;
+  s->typedNext = typedNext;
+  memcpy(s->paddles, paddles, 4);
+  s->buttons = buttons;
+  s->paddleTrigger = paddleTrigger;
+  s->video = video;
+  s->banks = banks;
+  s->mapBank = mapBank;
+  memcpy(s->ram, ram, card80 ? 2 * RAMSIZE : RAMSIZE);
+}
+
+static void takeSnapshot(){
+  struct Snapshot *s;
+  if (snapCount == SNAPSLOTS) snapFirst = (snapFirst + 1) % SNAPSLOTS;
+  else snapCount++;
+  s = snapshot(snapCount - 1);
+  saveState(s);
+  if (pagesFile) storeSnapshot(s);
+}
+
+static void restoreDevices(const struct Snapshot *s){  // all but the memory
+  ticks = s->ticks;
+  reg = s->reg;
+  key = s->key;
+  typedNext = s->typedNext;
+  memcpy(paddles, s->paddles, 4);
+  buttons = s->buttons;
+  paddleTrigger = s->paddleTrigger;
+  video = frameVideo = s->video;
+  videoLogCount = 0;
+  banks = s->banks;
+  if (card80) mapBanks();                        // else all pages are main
+  mapBank = s->mapBank;
+  dirtyRows[0] = dirtyRows[1] = ALLROWS;
+}
+
+static void restoreSnapshot(struct Snapshot *s){
+  restoreDevices(s);
+  memcpy(ram, s->ram, card80 ? 2 * RAMSIZE : RAMSIZE);
+  memset(written, WRITTEN, 2 * RAMSIZE >> 8);
+  dropBlocks();
+  if (lockstep) syncReference();
+}
+
+static void logEvent(uint8_t type, uint8_t value){
+  if (eventCount == eventSize){
+    eventSize = eventSize ? eventSize * 2 : 1024;
+    events = realloc(events, eventSize * sizeof(struct Event));
+  }
+  events[eventCount].ticks = ticks;
+  events[eventCount].type = type;
+  events[eventCount++].value = value;
+}
+
+static void input(uint8_t type, uint8_t value){  // applies a logged event
+  if (type == EV_RESET) reset();
+  else if (type == EV_BUTTONS) buttons = value;
+  else paddles[type - EV_PADDLE0] = value;
+}
+
+static void forgetFuture(){  // we resume from the past : drop the old future
+  while (snapCount > 1 && snapshot(snapCount - 1)->ticks > ticks) snapCount--;
+  while (eventCount && events[eventCount - 1].ticks >= ticks) eventCount--;
+  while (typedCount > typedNext && typed[typedCount - 1].ticks >= ticks) typedCount--;
+}
+
+static int snapshotBefore(uint64_t cycle){  // newest snapshot strictly before
+  for (int n=snapCount-1; n>=0; n--)
+    if (snapshot(n)->ticks < cycle) return(n);
+  return(-1);
+}
+
+static uint64_t replay(uint64_t target){  // from the restored snapshot to target
+  size_t e = 0;                           // returns the last instruction start
+  uint64_t last = ticks;
+  bool wasProfiling = profiling;          // the replayed cycles were counted
+  bool wasNative = natives;               // to stop inside the native loops
+  profiling = natives = false;
+  while (e < eventCount && events[e].ticks < ticks) e++;
+  while (ticks < target){
+    for (; e < eventCount && events[e].ticks == ticks; e++)
+      input(events[e].type, events[e].value);
+    last = ticks;
+    step();
+  }
+  profiling = wasProfiling;
+  natives = wasNative;
+  return(last);
+}
+
+static bool rewindTo(uint64_t target){  // back to the start of an instruction
+  int n = snapshotBefore(target + 1);
+  if (n < 0) return(false);
+  restoreSnapshot(snapshot(n));
+  replay(target);
+  return(true);
+}
+
+static bool reverseStep(){  // back to the previous instruction
+  int n = snapshotBefore(ticks);
+  uint64_t now = ticks;
+  if (n < 0) return(false);
+  restoreSnapshot(snapshot(n));
+  return(rewindTo(replay(now)));
+}
+
+static bool reverseContinue(){  // back to the last write to the watched address
+  uint64_t now = ticks, limit = ticks;
+  for (int n=snapshotBefore(now); n>=0; n--){
+    restoreSnapshot(snapshot(n));
+    watchFound = false;
+    replay(limit);
+    if (watchFound && watchHit < now) return(rewindTo(watchHit));
+    limit = snapshot(n)->ticks;
+  }
+  rewindTo(now);                // not found, stay where we are
+  return(false);
+}
+
+
+// SNAPSHOT STORE
+
+// -S DIR keeps the snapshots taken in a directory, and the last one of a
+// headless run. Memory is cut in pages of 256 bytes, stored once by their
+// content : pages.pack has each distinct page after its 64 bit hash, run
+// length encoded (PackBits) when that is shorter, snapshots.pack has the
+// registers and switches of each snapshot and the numbers of its pages in
+// pages.pack. Both files are only appended to, a partial record at the end
+// is cut when the store is opened. -i N starts from the snapshot N of the
+// store. -Z DIR reports the store and its dedup ratio, with -K N it keeps
+// the N newest snapshots and writes both files again without the pages
+// they do not use, as pages.G.pack and snapshots.G.pack : the generation G
+// in DIR/current switches to the new pair with one rename, a crash leaves
+// the old pair or the new one.
+
+#define STOREPAGES (2 * RAMSIZE >> 8)  // of a snapshot, at most
+
+struct StoredSnapshot{             // then its page numbers
+  char magic[4];                   // "R2SS"
+  uint32_t pageCount;              // RAMSIZE / 256, twice with -x
+  uint64_t ticks, paddleTrigger;
+  struct Register reg;
+  uint8_t key, paddles[4], buttons, video, banks;
+  uint32_t mapBank;
+};
+
+uint64_t *pageHashes = NULL, *pageOffsets = NULL, *snapOffsets = NULL;
+uint32_t pageTotal = 0, pageRoom = 0, snapTotal = 0;
+uint32_t *pageSlots = NULL, slotCount = 0;  // page number + 1, by hash
+
+#define FNVBASIS 14695981039346656037ull
+
+static uint64_t fnv64(uint64_t hash, const void *bytes, size_t size){  // FNV-1a
+  const uint8_t *data = bytes;
+  while (size--) hash = (hash ^ *data++) * 1099511628211ull;
+  return(hash);
+}
+
+static int packPage(const uint8_t *page, uint8_t *out){  // PackBits
+  int n = 0;
+  for (int i=0; i<256;){
+    int run = 1, literal = 0;
+    while (i + run < 256 && run < 128 && page[i + run] == page[i]) run++;
+    if (run > 2){
+      out[n++] = 257 - run;
+      out[n++] = page[i];
+      i += run;
+      continue;
+    }
+    while (i + literal < 256 && literal < 128 && !(i + literal + 2 < 256
+           && page[i + literal] == page[i + literal + 1]
+           && page[i + literal] == page[i + literal + 2])) literal++;
+    out[n++] = literal - 1;
+    memcpy(out + n, page + i, literal);
+    n += literal;
+    i += literal;
+  }
+  return(n);
+}
+
+static bool unpackPage(const uint8_t *in, int size, uint8_t *page){
+  int n = 0;
+  for (int i=0; i<size;){
+    int count = in[i] < 128 ? in[i] + 1 : 257 - in[i];
+    if (n + count > 256 || i + 1 + (in[i] < 128 ? count : 1) > size) return(false);
+    if (in[i] < 128) memcpy(page + n, in + i + 1, count);
+    else memset(page + n, in[i + 1], count);
+    i += 1 + (in[i] < 128 ? count : 1);
+    n += count;
+  }
+  return(n == 256);
+}
+
+static uint32_t *pageSlot(uint64_t hash){        // a free one
+  uint32_t slot = hash & (slotCount - 1);
+  while (pageSlots[slot]) slot = (slot + 1) & (slotCount - 1);
+  return(&pageSlots[slot]);
+}
+
+static void indexPage(uint64_t hash, uint64_t offset){
+  if (pageTotal == pageRoom){
+    pageRoom = pageRoom ? pageRoom * 2 : 4096;
+    pageHashes = realloc(pageHashes, pageRoom * sizeof(uint64_t));
+    pageOffsets = realloc(pageOffsets, pageRoom * sizeof(uint64_t));
+  }
+  if (2 * (pageTotal + 1) > slotCount){           // at most half full
+    slotCount *= 2;
+    free(pageSlots);
+    pageSlots = calloc(slotCount, sizeof(uint32_t));
+    for (uint32_t n=0; n<pageTotal; n++) *pageSlot(pageHashes[n]) = n + 1;
+  }
+  pageHashes[pageTotal] = hash;
+  pageOffsets[pageTotal++] = offset;
+  *pageSlot(hash) = pageTotal;
+}
+
+static bool loadPage(FILE *f, uint64_t offset, uint8_t *page){
+  uint8_t data[256];
+  uint16_t size;
+  if (fseek(f, offset + 8, SEEK_SET) || fread(&size, 2, 1, f) != 1
+      || size > 256 || fread(data, 1, size, f) != size) return(false);
+  if (size < 256) return(unpackPage(data, size, page));
+  memcpy(page, data, 256);
+  return(true);
+}
+
+static uint32_t storePage(const uint8_t *page){  // its number
+  uint64_t hash = fnv64(FNVBASIS, page, 256);
+  uint8_t packed[258], same[256];
+  for (uint32_t slot=hash & (slotCount - 1); pageSlots[slot]; slot=(slot + 1) & (slotCount - 1)){
+    uint32_t n = pageSlots[slot] - 1;            // the same hash, the same bytes ?
+    if (pageHashes[n] == hash && loadPage(pagesFile, pageOffsets[n], same)
+        && !memcmp(same, page, 256)) return(n);
+  }
+  int size = packPage(page, packed);
+  uint16_t stored = size < 256 ? size : 256;
+  fseek(pagesFile, 0, SEEK_END);
+  indexPage(hash, ftell(pagesFile));
+  fwrite(&hash, 8, 1, pagesFile);
+  fwrite(&stored, 2, 1, pagesFile);
+  fwrite(size < 256 ? packed : page, 1, stored, pagesFile);
+  return(pageTotal - 1);
+}
+
+static void storeSnapshot(const struct Snapshot *s){
+  uint32_t count = (card80 ? 2 : 1) * (RAMSIZE >> 8), numbers[STOREPAGES];
+  struct StoredSnapshot stored = {"R2SS", count, s->ticks, s->paddleTrigger, s->reg,
+    s->key, {s->paddles[0], s->paddles[1], s->paddles[2], s->paddles[3]},
+    s->buttons, s->video, s->banks, s->mapBank};
+  for (uint32_t n=0; n<count; n++) numbers[n] = storePage(s->ram + (n << 8));
+  fflush(pagesFile);                             // pages first
+  fseek(snapsFile, 0, SEEK_END);
+  snapOffsets = realloc(snapOffsets, (snapTotal + 1) * sizeof(uint64_t));
+  snapOffsets[snapTotal++] = ftell(snapsFile);
+  fwrite(&stored, sizeof(stored), 1, snapsFile);
+  fwrite(numbers, sizeof(uint32_t), count, snapsFile);
+  fflush(snapsFile);
+}
+
+static uint64_t packSize(FILE *f){
+  struct stat st;
+  return(fstat(fileno(f), &st) ? 0 : st.st_size);
+}
+
+static char *packPath(const char *dir, const char *kind, unsigned generation){
+  static char path[4096];
+  if (generation) snprintf(path, sizeof(path), "%s/%s.%u.pack", dir, kind, generation);
+  else snprintf(path, sizeof(path), "%s/%s.pack", dir, kind);
+  return(path);
+}
+
+static unsigned storeGeneration(const char *dir){  // named in DIR/current
+  char path[strlen(dir) + 16];
+  unsigned generation = 0;
+  snprintf(path, sizeof(path), "%s/current", dir);
+  FILE *f = fopen(path, "r");
+  if (f && fscanf(f, "%u", &generation) != 1) generation = 0;
+  if (f) fclose(f);
+  return(generation);
+}
+
+static FILE *openPack(const char *dir, const char *kind, unsigned generation, const char *mode){
+  return(fopen(packPath(dir, kind, generation), mode));
+}
+
+static bool openStore(const char *dir){          // and index it
+  struct StoredSnapshot stored;
+  uint64_t hash, good = 0;
+  uint16_t size;
+  if (!pageSlots) pageSlots = calloc(slotCount = 8192, sizeof(uint32_t));
+  mkdir(dir, 0777);
+  pagesFile = openPack(dir, "pages", storeGeneration(dir), "a+b");
+  snapsFile = openPack(dir, "snapshots", storeGeneration(dir), "a+b");
+  if (!pagesFile || !snapsFile) return(false);
+  rewind(pagesFile);
+  while (fread(&hash, 8, 1, pagesFile) == 1 && fread(&size, 2, 1, pagesFile) == 1
+         && size <= 256 && !fseek(pagesFile, size, SEEK_CUR)
+         && good + 10 + size <= packSize(pagesFile)){
+    indexPage(hash, good);
+    good += 10 + size;
+  }
+  if (ftruncate(fileno(pagesFile), good)) return(false);  // a partial page
+  rewind(snapsFile);
+  good = 0;
+  while (fread(&stored, sizeof(stored), 1, snapsFile) == 1
+         && !memcmp(stored.magic, "R2SS", 4) && stored.pageCount <= STOREPAGES
+         && !fseek(snapsFile, stored.pageCount * sizeof(uint32_t), SEEK_CUR)
+         && good + sizeof(stored) + stored.pageCount * sizeof(uint32_t)
+            <= packSize(snapsFile)){
+    snapOffsets = realloc(snapOffsets, (snapTotal + 1) * sizeof(uint64_t));
+    snapOffsets[snapTotal++] = good;
+    good += sizeof(stored) + stored.pageCount * sizeof(uint32_t);
+  }
+  return(!ftruncate(fileno(snapsFile), good));
+}
+
+static bool readStored(uint32_t n, struct StoredSnapshot *stored, uint32_t *numbers){
+  if (n >= snapTotal || fseek(snapsFile, snapOffsets[n], SEEK_SET)
+      || fread(stored, sizeof(*stored), 1, snapsFile) != 1
+      || fread(numbers, sizeof(uint32_t), stored->pageCount, snapsFile) != stored->pageCount)
+    return(false);
+  for (uint32_t p=0; p<stored->pageCount; p++)
+    if (numbers[p] >= pageTotal) return(false);
+  return(true);
+}
+
+static bool loadStored(uint32_t n){              // into the machine
+  static struct Snapshot s;
+  struct StoredSnapshot stored;
+  uint32_t numbers[STOREPAGES];
+  if (!readStored(n, &stored, numbers)
+      || stored.pageCount != (card80 ? 2 : 1) * (RAMSIZE >> 8)) return(false);
+  for (uint32_t p=0; p<stored.pageCount; p++)
+    if (!loadPage(pagesFile, pageOffsets[numbers[p]], s.ram + (p << 8))) return(false);
+  s.ticks = stored.ticks;
+  s.reg = stored.reg;
+  s.key = stored.key;
+  s.typedNext = typedNext;                       // the keys of this run
+  memcpy(s.paddles, stored.paddles, 4);
+  s.buttons = stored.buttons;
+  s.paddleTrigger = stored.paddleTrigger;
+  s.video = stored.video;
+  s.banks = stored.banks;
+  s.mapBank = stored.mapBank;
+  restoreSnapshot(&s);
+  return(true);
+}
+
+static int reportStore(const char *dir, uint32_t keep){  // -Z DIR, -K N
+  struct StoredSnapshot stored;
+  uint32_t numbers[STOREPAGES], first, *renumber, used = 0, stored0;
+  unsigned generation = storeGeneration(dir);
+  uint64_t refs = 0, logical = 0, bytes;
+  uint8_t page[256];
+  if (!openStore(dir)){
+    fprintf(stderr, "can't open store %s\n", dir);
+    return(1);
+  }
+  first = keep && keep < snapTotal ? snapTotal - keep : 0;
+  renumber = calloc(pageTotal + 1, sizeof(uint32_t));  // new number + 1
+  for (uint32_t n=first; n<snapTotal; n++){
+    if (!readStored(n, &stored, numbers)){
+      fprintf(stderr, "snapshot %u is damaged\n", n);
+      return(1);
+    }
+    for (uint32_t p=0; p<stored.pageCount; p++)
+      if (!renumber[numbers[p]]) renumber[numbers[p]] = ++used;
+    refs += stored.pageCount;
+  }
+  if (keep){                                     // collect the garbage
+    FILE *pages = openPack(dir, "pages", generation + 1, "wb");
+    FILE *snaps = openPack(dir, "snapshots", generation + 1, "wb");
+    char current[strlen(dir) + 16], temp[strlen(dir) + 16];
+    uint8_t packed[258];
+    uint32_t *order = malloc((used + 1) * sizeof(uint32_t));
+    if (!pages || !snaps) return(1);
+    for (uint32_t n=0; n<pageTotal; n++) if (renumber[n]) order[renumber[n] - 1] = n;
+    for (uint32_t n=0; n<used; n++){             // in their new order
+      int size;
+      uint16_t length;
+      if (!loadPage(pagesFile, pageOffsets[order[n]], page)) return(1);
+      size = packPage(page, packed);
+      length = size < 256 ? size : 256;
+      fwrite(&pageHashes[order[n]], 8, 1, pages);
+      fwrite(&length, 2, 1, pages);
+      fwrite(size < 256 ? packed : page, 1, length, pages);
+    }
+    for (uint32_t n=first; n<snapTotal; n++){
+      readStored(n, &stored, numbers);
+      for (uint32_t p=0; p<stored.pageCount; p++) numbers[p] = renumber[numbers[p]] - 1;
+      fwrite(&stored, sizeof(stored), 1, snaps);
+      fwrite(numbers, sizeof(uint32_t), stored.pageCount, snaps);
+    }
+    if (fflush(pages) || fflush(snaps) || fsync(fileno(pages)) || fsync(fileno(snaps))
+        || fclose(pages) || fclose(snaps)) return(1);
+    snprintf(current, sizeof(current), "%s/current", dir);
+    snprintf(temp, sizeof(temp), "%s/current.new", dir);
+    FILE *f = fopen(temp, "w");                  // both packs switched at once
+    if (!f || fprintf(f, "%u\n", generation + 1) < 0 || fflush(f) || fsync(fileno(f))
+        || fclose(f) || rename(temp, current)) return(1);
+    fclose(pagesFile);
+    fclose(snapsFile);
+    remove(packPath(dir, "pages", generation));
+    remove(packPath(dir, "snapshots", generation));
+    stored0 = pageTotal;
+    pageTotal = snapTotal = 0;
+    memset(pageSlots, 0, slotCount * sizeof(uint32_t));
+    if (!openStore(dir)) return(1);
+    printf("kept %u snapshots, dropped %u pages\n", snapTotal, stored0 - pageTotal);
+    first = 0;
+  }
+  bytes = packSize(pagesFile) + packSize(snapsFile);
+  logical = refs * 256 + (snapTotal - first) * sizeof(stored);
+  printf("%u snapshots, %llu pages referenced, %u distinct, %u stored\n",
+    snapTotal - first, (unsigned long long)refs, used, pageTotal);
+  printf("%llu bytes on disk, %llu per snapshot, dedup ratio %.1f\n",
+    (unsigned long long)bytes, (unsigned long long)(snapTotal ? bytes / snapTotal : 0),
+    bytes ? (double)logical / bytes : 0);
+  return(0);
+}
+
+
+// FUZZING HARNESS
+
+// libFuzzer entry point, built with make fuzz. The input is a machine :
+// A X Y SR SP PCL PCH, the load address of the RAM image (low, high), the
+// length of the key script, the key script and the RAM image. Every run
+// starts from a snapshot of the booted machine, then executes FUZZCYCLES
+// cycles checking the instruction lengths, the stack pointer moves and the
+// agreement with the reference core. Any violation aborts. Going back to
+// the snapshot copies only the pages written by the last run (RESTORE in
+// written[]), in both cores : the reference writes what the core writes.
+
+#ifdef FUZZ
+
+#define FUZZCYCLES 1000
+
+int8_t fuzzLength[256], fuzzStack[256];  // per opcode, -1 length if it jumps
+
+static void fuzzTables(){
+  for (int opcode=0; opcode<256; opcode++){
+    void (*op)(void) = instruction[opcode];
+    int mode = modeOf(opcode);
+    fuzzLength[opcode] = mode < 0 ? 1 : modes[mode].length;
+    if (addressing[opcode] == REL || op == JMP || op == JSR || op == RTS
+      || op == RTI || op == BRK) fuzzLength[opcode] = -1;
+    if (op == PHA || op == PHP) fuzzStack[opcode] = -1;
+    if (op == PLA || op == PLP) fuzzStack[opcode] = 1;
+    if (op == JSR) fuzzStack[opcode] = -2;
+    if (op == RTS) fuzzStack[opcode] = 2;
+    if (op == BRK) fuzzStack[opcode] = -3;
+    if (op == RTI) fuzzStack[opcode] = 3;
+  }
+}
+
+static void fuzzReset(const struct Snapshot *s){
+  int pages = (card80 ? 2 : 1) * (RAMSIZE >> 8);
+  for (int p=0; p<pages; p++){
+    if (!(written[p] & RESTORE)) continue;
+    memcpy(ram + (p << 8), s->ram + (p << 8), 256);
+    memcpy(refRam + (p << 8), s->ram + (p << 8), 256);
+    written[p] &= ~RESTORE;
+    stale(p % (RAMSIZE >> 8) << 8);
+  }
+  restoreDevices(s);
+}
+
+static void fuzzStep(){
+  uint16_t pc = reg.PC;
+  uint8_t opcode = peek(pc), sp = reg.SP;
+  if (pc >= RAMSIZE && pc < ROMSTART) { step(); return; }  // opcode from I/O
+  step();
+  if (fuzzLength[opcode] > 0 && reg.PC != ((pc + fuzzLength[opcode]) & 0xFFFF)) abort();
+  if (instruction[opcode] != TXS && (uint8_t)(sp + fuzzStack[opcode]) != reg.SP) abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+  static bool booted = false;
+  size_t keys, next = 0;
+  uint16_t address;
+
+  if (!booted){                                  // boot once, keep the machine
+    FILE *f=fopen("appleII.rom","rb");
+    if (f == NULL) abort();
+    if (fread(rom, sizeof(uint8_t), ROMSIZE, f) != ROMSIZE) abort();
+    fclose(f);
+    startDecoder();
+    reset();
+    while (ticks < SNAPINTERVAL) step();
+    takeSnapshot();
+    syncReference();                             // the only full copy
+    fuzzTables();
+    lockstep = booted = true;
+  }
+  if (size < 10) return(0);
+
+  fuzzReset(snapshot(0));
+  reg.A  = data[0];
+  reg.X  = data[1];
+  reg.Y  = data[2];
+  reg.SR = data[3];
+  reg.SP = data[4];
+  reg.PC = data[5] | (data[6] << 8);
+  address = data[7] | (data[8] << 8);
+  keys = data[9];
+  if (keys > size - 10) keys = size - 10;
+  for (size_t i=10+keys; i<size; i++){
+    uint16_t at = address++ % RAMSIZE;
+    if (!(written[at >> 8] & RESTORE)) stale(at);  // first write of the run
+    written[at >> 8] = WRITTEN;
+    ram[at] = refRam[at] = data[i];
+  }
+  ref = reg;
+  ioCount = writeCount = 0;
+
+  uint64_t end = ticks + FUZZCYCLES;
+  while (ticks < end){
+    if (key < 0x80 && next < keys) key = data[10 + next++] | 0x80;
+    fuzzStep();
+  }
+  return(0);
+}
+
+#else
+
+
+// KEYBOARD, SCREEN AND HEADLESS RUNS
+
+static const uint16_t offsetsForRows[24] = {  // helper for video generation
+  0x400, 0x480, 0x500, 0x580, 0x600, 0x680, 0x700, 0x780,
+  0x428, 0x4A8, 0x528, 0x5A8, 0x628, 0x6A8, 0x728, 0x7A8,
+  0x450, 0x4D0, 0x550, 0x5D0, 0x650, 0x6D0, 0x750, 0x7D0
+};
+
+static uint8_t translateKey(int ch){  // host key to Apple II key, bit 7 set
+  uint8_t k = ch;
+  switch(k){                                     // key translations
+    case 0x0A: k = 0x0D; break;                  // LF    to CR
+    case 0x04: k = 0x08; break;                  // LEFT  to BS
+    case 0x05: k = 0x15; break;                  // RIGHT to NAK
+    case 0x07: k = 0x08; break;                  // BELL  to BS (!?)
+  }
+  if ((k>0x60) && (k<0x7B)) k&=0xDF;             // to upper case
+  return(k | 0x80);                              // set bit 7
+}
+
+static uint8_t toAscii(uint8_t glyph){
+  if (glyph == '`') glyph = '_';                 // change cursor shape
+  glyph &= 0x7F;                                 // unset bit 7
+  if (glyph > 0x5F) glyph &= 0x3F;               // shifts to match
+  if (glyph < 0x20) glyph |= 0x40;               // the ASCII codes
+  return(glyph);
+}
+
+// Each text row is drawn in its mode : lo-res as its two blocks, the lower
+// one as colored dots on the upper one, hi-res as the density of the lit
+// pixels of each 7x8 cell. The 80-column modes take the even cells from
+// the aux bank and the odd ones from main, each only if it changed.
+
+static const short loresColors[16] = {  // to the 8 colors of curses
+  COLOR_BLACK,  COLOR_RED,   COLOR_BLUE,  COLOR_MAGENTA,
+  COLOR_GREEN,  COLOR_WHITE, COLOR_BLUE,  COLOR_CYAN,
+  COLOR_YELLOW, COLOR_RED,   COLOR_WHITE, COLOR_MAGENTA,
+  COLOR_GREEN,  COLOR_YELLOW, COLOR_CYAN, COLOR_WHITE
+};
+
+static const char density[] = " .:-=+*#%@";
+
+chtype screen[24][80];
+uint8_t rowWidth[24];
+
+static void drawCells(int row, uint8_t mode, const uint8_t *bank, chtype *cell, int stride){
+  bool page2 = (mode & (PAGE2|STORE80)) == PAGE2;
+  const uint8_t *text = bank + offsetsForRows[row] + (page2 ? 0x400 : 0);
+  const uint8_t *hires = bank + offsetsForRows[row] + (page2 ? 0x3C00 : 0x1C00);
+  uint8_t glyph;
+  int lit;
+  for (int col=0; col<40; col++, cell += stride){
+    glyph = text[col];
+    if (mode & TEXT)                                   // text
+      *cell = toAscii(glyph)
+        | (glyph < 0x40 ? A_REVERSE : glyph > 0x7F ? A_NORMAL : A_BLINK);
+    else if (!(mode & HIRES))                          // lo-res
+      *cell = ((glyph >> 4) == (glyph & 0xF) ? ' ' : ':')
+        | COLOR_PAIR(loresColors[glyph >> 4] * 8 + loresColors[glyph & 0xF]);
+    else {                                             // hi-res
+      for (lit=0, glyph=0; glyph<8; glyph++)
+        lit += __builtin_popcount(hires[glyph * 0x400 + col] & 0x7F);
+      *cell = density[lit * 9 / 56];
+    }
+  }
+}
+
+static bool drawRow(int row){  // false if nothing changed
+  uint8_t mode = rowModes[row];
+  uint32_t main = dirtyRows[0] & (1 << row), aux = dirtyRows[1] & (1 << row);
+  int width;
+  if (mode & TEXT || (mode & MIXED && row >= 20)) mode = (mode & ~HIRES) | TEXT;
+  width = mode & COL80 && (mode & TEXT || (mode & HIRES && mode & DHIRES)) ? 80 : 40;
+  if (width != rowWidth[row]){
+    rowWidth[row] = width;
+    main = aux = 1;
+    for (int col=40; col<80; col++) screen[row][col] = ' ';
+  }
+  if (width == 40 && main) drawCells(row, mode, ram, screen[row], 1);
+  if (width == 80 && aux)  drawCells(row, mode, ram + RAMSIZE, screen[row], 2);
+  if (width == 80 && main) drawCells(row, mode, ram, screen[row] + 1, 2);
+  return(main || (width == 80 && aux));
+}
+
+// JOYSTICK
+
+// -j FILE plays a joystick script, lines of "CYCLE PDL0 PDL1 PDL2 PDL3 BUTTONS",
+// -J DEVICE reads a Linux evdev device : the X, Y, RX, RY axes are PDL0 to
+// PDL3, the first three buttons PB0 to PB2. Changes are logged for replays.
+
+struct JoyLine{
+  unsigned long long ticks;
+  unsigned int paddles[4], buttons;
+}*joyScript = NULL;
+
+size_t joyCount = 0, joyNext = 0;
+uint64_t joyDue = UINT64_MAX;  // cycle of the next call to joystick()
+int joyDevice = -1;
+int joyMin[4], joyMax[4];      // range of the device axes
+
+static void setInput(uint8_t type, uint8_t value){
+  if (type == EV_BUTTONS ? buttons == value : paddles[type - EV_PADDLE0] == value) return;
+  input(type, value);
+  logEvent(type, value);
+}
+
+static void readJoyScript(const char *filename){
+  FILE *f = fopen(filename, "r");
+  struct JoyLine j = {0};
+  if (!f) return;
+  while (fscanf(f, "%llu %u %u %u %u %u", &j.ticks, &j.paddles[0], &j.paddles[1],
+                &j.paddles[2], &j.paddles[3], &j.buttons) == 6){
+    joyScript = realloc(joyScript, (joyCount + 1) * sizeof(struct JoyLine));
+    joyScript[joyCount++] = j;
+  }
+  fclose(f);
+  if (joyCount) joyDue = joyScript[0].ticks;
+}
+
+static void openJoyDevice(const char *filename){
+#ifdef __linux__
+  static const int axes[4] = {ABS_X, ABS_Y, ABS_RX, ABS_RY};
+  struct input_absinfo info;
+  joyDevice = open(filename, O_RDONLY | O_NONBLOCK);
+  for (int n=0; n<4; n++){
+    joyMin[n] = 0, joyMax[n] = 255;            // a recorded file has no ioctl
+    if (joyDevice >= 0 && ioctl(joyDevice, EVIOCGABS(axes[n]), &info) == 0
+        && info.maximum > info.minimum)
+      joyMin[n] = info.minimum, joyMax[n] = info.maximum;
+  }
+  if (joyDevice >= 0) joyDue = 0;
+#endif
+}
+
+static void joystick(){  // applies what is due, joyDue is the next call
+  for (; joyNext < joyCount && joyScript[joyNext].ticks <= ticks; joyNext++){
+    for (int n=0; n<4; n++) setInput(EV_PADDLE0 + n, joyScript[joyNext].paddles[n]);
+    setInput(EV_BUTTONS, joyScript[joyNext].buttons);
+  }
+  joyDue = joyNext < joyCount ? joyScript[joyNext].ticks : UINT64_MAX;
+#ifdef __linux__
+  struct input_event ev;
+  int n;
+  if (joyDevice < 0) return;
+  while (read(joyDevice, &ev, sizeof(ev)) == sizeof(ev)){
+    if (ev.type == EV_ABS){
+      n = ev.code == ABS_X ? 0 : ev.code == ABS_Y ? 1 : ev.code == ABS_RX ? 2 : ev.code == ABS_RY ? 3 : -1;
+      if (n >= 0) setInput(EV_PADDLE0 + n, (ev.value - joyMin[n]) * 255 / (joyMax[n] - joyMin[n]));
+    }
+    if (ev.type == EV_KEY && (ev.code & 0xFFE0) == 0x120 && (n = ev.code & 0xF) < 3)
+      setInput(EV_BUTTONS, ev.value ? buttons | 1 << n : buttons & ~(1 << n));
+  }
+  if (joyDue > ticks + 10000) joyDue = ticks + 10000;  // polled every ~10ms
+#endif
+}
+
+// -b CYCLES runs without ncurses for that many cycles, the keys of -k FILE
+// are all typed ahead at once. The screen
+// is printed on stdout at the end, the speed on stderr. Used as benchmark
+// and as the PGO training workload (see the Makefile).
+
+static void printScreen(FILE *out){
+  memset(rowModes, video, 24);
+  dirtyRows[0] = dirtyRows[1] = ALLROWS;
+  for (int row=0; row<24; row++){
+    drawRow(row);
+    for (int col=0; col<rowWidth[row]; col++) fputc(screen[row][col] & A_CHARTEXT, out);
+    fputc('\n', out);
+  }
+}
+
+const char *memoDir = NULL;    // -M, see JOB MEMO CACHE
+static bool recall(uint64_t budget);
+static void remember(uint64_t total, char *text, size_t size);
+
+static void headless(uint64_t budget, FILE *keys[]){  // keys of each machine
+  struct timespec start, end;
+  double seconds;
+  uint64_t total = 0, begun[MACHINES];         // cycles, from -i N maybe
+  int ch;
+  FILE *out;
+  char *text = NULL;
+  size_t size = 0;
+  for (int n=0; n<machineCount; n++){
+    switchMachine(n);
+    begun[n] = ticks;
+    while (keys[n] && (ch = fgetc(keys[n])) != EOF) typeKey(translateKey(ch));
+  }
+  switchMachine(0);
+  if (memoDir && recall(budget)) return;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (ticks < budget){
+    if (machineCount > 1) runMachines(budget - timeline < QUANTUM ? budget : timeline + QUANTUM);
+    else step();
+    if (ticks >= joyDue) joystick();
+    if (ticks >= sampleDue) sample();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  out = memoDir ? open_memstream(&text, &size) : stdout;
+  for (int n=0; n<machineCount; n++){
+    switchMachine(n);
+    if (n) fprintf(out, "----- machine %d\n", n);
+    printScreen(out);
+    total += ticks - begun[n];
+  }
+  switchMachine(0);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%llu cycles in %.3f s : %.2f MHz\n",
+    (unsigned long long)total, seconds, total / seconds / 1e6);
+  if (paddleReads) fprintf(stderr, "%llu of %llu paddle reads fast-forwarded\n",
+    (unsigned long long)paddleSkips, (unsigned long long)paddleReads);
+  if (!memoDir) return;
+  fclose(out);
+  remember(total, text, size);
+}
+
+
+// JOB MEMO CACHE
+
+// Headless runs are deterministic : -M DIR keeps their results in DIR, keyed
+// by a hash of what they depend on (the ROM, the switches, the starting
+// state and typed keys of each machine, the joystick script and the cycle
+// budget), and a repeated job prints the cached screens instead of running.
+// The key also covers the emulator itself, a hash of its executable : a
+// build whose core gives other results does not read those of the last.
+// The memory digest (FNV-1a of the RAM of each machine at the end) is
+// printed on stderr with the count of hits. The least recently used results
+// are deleted when the cache grows over MEMOBYTES.
+
+#define MEMOVERSION 1          // to bump when the results of a job change
+#define MEMOBYTES   (64 << 20)
+
+struct MemoHeader{             // then the screens
+  char magic[4];               // "R2MJ"
+  uint32_t version;
+  uint64_t key, total, digest, size;
+};
+
+uint64_t memoKey;
+
+static char *memoPath(const char *name){
+  static char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", memoDir, name);
+  return(path);
+}
+
+static uint64_t machineHash(uint64_t hash){   // of the current machine
+  hash = fnv64(hash, ram, card80 ? 2 * RAMSIZE : RAMSIZE);
+  hash = fnv64(hash, &reg.PC, 2);
+  hash = fnv64(hash, &reg, 5);                  // A X Y SR SP
+  hash = fnv64(hash, &ticks, 8);
+  hash = fnv64(hash, &key, 1);
+  hash = fnv64(hash, paddles, 4);
+  hash = fnv64(hash, &buttons, 1);
+  hash = fnv64(hash, &paddleTrigger, 8);
+  hash = fnv64(hash, &video, 1);
+  hash = fnv64(hash, &banks, 1);
+  for (size_t n=typedNext; n<typedCount; n++){
+    hash = fnv64(hash, &typed[n].ticks, 8);
+    hash = fnv64(hash, &typed[n].key, 1);
+  }
+  return(hash);
+}
+
+static uint64_t buildHash(uint64_t hash){       // of the executable running
+  struct stat st;
+  int fd = open("/proc/self/exe", O_RDONLY);
+  void *image = MAP_FAILED;
+  if (fd >= 0 && !fstat(fd, &st))
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd >= 0) close(fd);
+  if (image == MAP_FAILED)                       // no procfs : the build time then
+    return(fnv64(hash, __DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__)));
+  hash = fnv64(hash, image, st.st_size);
+  munmap(image, st.st_size);
+  return(hash);
+}
+
+static void memoStats(bool hit){                // counted in DIR/stats
+  unsigned long long lookups = 0, hits = 0;
+  char counts[64];
+  int fd = open(memoPath("stats"), O_RDWR | O_CREAT, 0666), n;
+  if (fd < 0) return;
+  flock(fd, LOCK_EX);                            // jobs running at once wait here
+  n = pread(fd, counts, sizeof(counts) - 1, 0);
+  counts[n > 0 ? n : 0] = 0;
+  if (sscanf(counts, "%llu %llu", &lookups, &hits) != 2) lookups = hits = 0;
+  lookups++;
+  hits += hit;
+  n = snprintf(counts, sizeof(counts), "%llu %llu\n", lookups, hits);
+  if (pwrite(fd, counts, n, 0) != n || ftruncate(fd, n)) fprintf(stderr, "can't count in %s\n", memoPath("stats"));
+  close(fd);                                     // and unlocks
+  fprintf(stderr, "memo cache : %llu hits of %llu lookups (%.0f%%)\n",
+    hits, lookups, 100.0 * hits / lookups);
+}
+
+static bool recall(uint64_t budget){
+  uint64_t hash = FNVBASIS, version = MEMOVERSION;
+  struct MemoHeader header;
+  char name[32], *text = NULL;
+  FILE *f;
+  hash = fnv64(hash, &version, 8);
+  hash = buildHash(hash);
+  hash = fnv64(hash, rom, ROMSIZE);
+  hash = fnv64(hash, &budget, 8);
+  hash = fnv64(hash, &card80, 1);
+  hash = fnv64(hash, &natives, 1);
+  hash = fnv64(hash, &machineCount, sizeof(machineCount));
+  for (int n=0; n<machineCount; n++) switchMachine(n), hash = machineHash(hash);
+  switchMachine(0);
+  for (size_t n=0; n<joyCount; n++){              // field by field, not the padding
+    hash = fnv64(hash, &joyScript[n].ticks, sizeof(joyScript[n].ticks));
+    hash = fnv64(hash, joyScript[n].paddles, sizeof(joyScript[n].paddles));
+    hash = fnv64(hash, &joyScript[n].buttons, sizeof(joyScript[n].buttons));
+  }
+  memoKey = hash;
+  mkdir(memoDir, 0777);
+  snprintf(name, sizeof(name), "%016llx.memo", (unsigned long long)memoKey);
+  if (!(f = fopen(memoPath(name), "rb"))
+      || fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "R2MJ", 4)
+      || header.version != MEMOVERSION || header.key != memoKey
+      || !(text = malloc(header.size + 1)) || fread(text, 1, header.size, f) != header.size){
+    if (f) fclose(f);
+    free(text);
+    memoStats(false);
+    return(false);
+  }
+  fclose(f);
+  utime(memoPath(name), NULL);                   // recently used
+  fwrite(text, 1, header.size, stdout);
+  free(text);
+  fprintf(stderr, "%llu cycles from the memo cache, memory %016llx\n",
+    (unsigned long long)header.total, (unsigned long long)header.digest);
+  memoStats(true);
+  return(true);
+}
+
+static void evict(){                             // the oldest, over MEMOBYTES
+  struct Entry{ char name[32]; time_t used; off_t size; } *entries = NULL;
+  size_t count = 0, bytes = 0;
+  struct dirent *e;
+  struct stat st;
+  DIR *dir = opendir(memoDir);
+  if (!dir) return;
+  while ((e = readdir(dir)))
+    if (strlen(e->d_name) == 21 && !strcmp(e->d_name + 16, ".memo")
+        && !stat(memoPath(e->d_name), &st)){
+      entries = realloc(entries, (count + 1) * sizeof(struct Entry));
+      strcpy(entries[count].name, e->d_name);
+      entries[count].used = st.st_mtime;
+      entries[count++].size = st.st_size;
+      bytes += st.st_size;
+    }
+  closedir(dir);
+  while (bytes > MEMOBYTES && count){
+    size_t oldest = 0;
+    for (size_t n=1; n<count; n++) if (entries[n].used < entries[oldest].used) oldest = n;
+    unlink(memoPath(entries[oldest].name));
+    bytes -= entries[oldest].size;
+    entries[oldest] = entries[--count];
+  }
+  free(entries);
+}
+
+static void remember(uint64_t total, char *text, size_t size){
+  struct MemoHeader header = {"R2MJ", MEMOVERSION, memoKey, total, FNVBASIS, size};
+  char name[32], temp[32];
+  FILE *f;
+  for (int n=0; n<machineCount; n++)
+    switchMachine(n), header.digest = fnv64(header.digest, ram, card80 ? 2 * RAMSIZE : RAMSIZE);
+  switchMachine(0);
+  fwrite(text, 1, size, stdout);
+  fprintf(stderr, "memory %016llx\n", (unsigned long long)header.digest);
+  snprintf(name, sizeof(name), "%016llx.memo", (unsigned long long)memoKey);
+  snprintf(temp, sizeof(temp), "%016llx.%d", (unsigned long long)memoKey, (int)getpid());
+  if ((f = fopen(memoPath(temp), "wb"))){        // then renamed, for parallel jobs
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(text, 1, size, f);
+    if (fclose(f) == 0){
+      char *path = strdup(memoPath(name));
+      rename(memoPath(temp), path);
+      free(path);
+    }
+  }
+  free(text);
+  evict();
+}
+
+
+// STATE-SPACE EXPLORATION
+
+// -e FILE explores the inputs of an interactive program from the start
+// state (after -k FILE, or from -i N) : at each prompt, the guest in KEYIN
+// with no key queued, each line of FILE is typed in turn and the machine
+// runs to the next prompt, -b CYCLES at most. The state reached is hashed
+// and pruned if any worker has seen it, otherwise explored in turn, down to
+// -d N inputs. Workers are processes : a branch is forked while one of the
+// -P N workers is idle, its memory shared copy-on-write with the branch
+// point. The state hash is kept by page, only the pages written since the
+// last hash are hashed again. Inputs that leave the guest running without
+// a prompt are printed, the counts at the end.
+
+#define KEYIN    0xFD1B      // to the BPL back at $FD24
+#define SEENSIZE (1 << 22)     // state hashes, a power of 2
+#define MAXDEPTH 64
+
+struct Tally{                  // shared by the workers
+  atomic_ullong states, fresh, pruned, leaves, full;
+  atomic_int idle, live;
+  _Atomic uint64_t seen[SEENSIZE];
+}*tally;
+
+char **inputs = NULL;
+int inputCount = 0, maxDepth = 4, path[MAXDEPTH];
+uint64_t branchCycles;
+uint64_t pageHash[2 * RAMSIZE >> 8];
+
+static bool readInputs(const char *filename){
+  FILE *f = fopen(filename, "r");
+  char *line = NULL;
+  size_t size = 0;
+  if (!f) return(false);
+  while (getline(&line, &size, f) > 0){
+    inputs = realloc(inputs, (inputCount + 1) * sizeof(char *));
+    inputs[inputCount++] = strdup(line);
+  }
+  free(line);
+  fclose(f);
+  return(inputCount > 0);
+}
+
+static uint64_t stateHash(){   // of the pages, registers and switches
+  int pages = (card80 ? 2 : 1) * (RAMSIZE >> 8);
+  uint64_t hash;
+  for (int p=0; p<pages; p++)
+    if (written[p] & REHASH){
+      pageHash[p] = fnv64(FNVBASIS, ram + (p << 8), 256);
+      written[p] &= ~REHASH;
+    }
+  hash = fnv64(FNVBASIS, pageHash, pages * sizeof(uint64_t));
+  hash = fnv64(hash, &reg.PC, 2);
+  hash = fnv64(hash, &reg, 5);
+  hash = fnv64(hash, &key, 1);
+  hash = fnv64(hash, paddles, 4);
+  hash = fnv64(hash, &buttons, 1);
+  hash = fnv64(hash, &video, 1);
+  return(fnv64(hash, &banks, 1));
+}
+
+static bool firstSeen(uint64_t hash){  // lock-free, across the workers
+  hash |= 1;                           // 0 is a free slot
+  for (uint32_t n=0, slot=hash & (SEENSIZE - 1); n<64; n++, slot=(slot + 1) & (SEENSIZE - 1)){
+    uint64_t free = 0;
+    if (atomic_compare_exchange_strong(&tally->seen[slot], &free, hash)) return(true);
+    if (free == hash) return(false);
+  }
+  tally->full++;                       // not kept, explored again
+  return(true);
+}
+
+static bool prompt(){
+  return((uint16_t)(reg.PC - KEYIN) < 11 && key < 0x80 && typedNext == typedCount);
+}
+
+static bool runToPrompt(){
+  uint64_t end = ticks + branchCycles;
+  while (ticks < end && !prompt()) step();
+  return(prompt());
+}
+
+static pid_t forkWorker(){
+  while (atomic_load(&queueHead) != atomic_load(&queueTail)) sched_yield();  // nothing in flight
+  pid_t pid = fork();
+  if (pid == 0) startDecoder();                  // threads are not forked
+  return(pid);
+}
+
+static bool idleWorker(){                         // and take it
+  int idle = tally->idle;
+  while (idle > 0)
+    if (atomic_compare_exchange_weak(&tally->idle, &idle, idle - 1)) return(true);
+  return(false);
+}
+
+static void explore(int depth);
+
+static void tryInput(int input, int depth){      // from a prompt
+  path[depth] = input;
+  for (char *c=inputs[input]; *c; c++) typeKey(translateKey(*c));
+  bool waiting = runToPrompt();
+  tally->states++;
+  if (!firstSeen(stateHash())){
+    tally->pruned++;
+    return;
+  }
+  tally->fresh++;
+  if (!waiting){                                  // no prompt, report it
+    char line[4096];
+    int n = snprintf(line, sizeof(line), "no prompt after");
+    for (int d=0; d<=depth && n < (int)sizeof(line) - 80; d++)
+      n += snprintf(line + n, sizeof(line) - n, "%s%.*s", d ? " | " : " ",
+                    (int)strcspn(inputs[path[d]], "\n"), inputs[path[d]]);
+    line[n++] = '\n';
+    fwrite(line, 1, n, stdout);
+    fflush(stdout);
+  }
+  if (!waiting || depth + 1 == maxDepth) tally->leaves++;
+  else explore(depth + 1);
+}
+
+static void explore(int depth){                   // all the inputs at a prompt
+  struct Snapshot *at = malloc(sizeof(struct Snapshot));
+  uint64_t *hashes = malloc(sizeof(pageHash));
+  saveState(at);
+  memcpy(hashes, pageHash, sizeof(pageHash));
+  for (int i=0; i<inputCount; i++){
+    if (i){                                       // back to the prompt
+      restoreSnapshot(at);
+      typedCount = typedNext;
+      memcpy(pageHash, hashes, sizeof(pageHash));
+      memset(written, RESTORE, 2 * RAMSIZE >> 8);
+    }
+    if (i < inputCount - 1 && idleWorker()){
+      tally->live++;
+      pid_t pid = forkWorker();
+      if (pid == 0){
+        tryInput(i, depth);
+        tally->idle++;
+        tally->live--;
+        _exit(0);
+      }
+      if (pid > 0) continue;
+      tally->live--;                               // not forked, run it here
+      tally->idle++;
+    }
+    tryInput(i, depth);
+  }
+  free(hashes);
+  free(at);
+}
+
+static int exploreAll(const char *filename, FILE *keys, uint64_t budget, int workers){
+  struct timespec start, end;
+  double seconds;
+  int ch;
+  if (!readInputs(filename)){
+    fprintf(stderr, "no inputs in %s\n", filename);
+    return(1);
+  }
+  tally = mmap(NULL, sizeof(struct Tally), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (tally == MAP_FAILED) return(1);
+  tally->idle = workers - 1;
+  signal(SIGCHLD, SIG_IGN);                       // the workers are not waited for
+  branchCycles = budget;
+  maxDepth = maxDepth < 1 ? 1 : maxDepth > MAXDEPTH ? MAXDEPTH : maxDepth;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (keys && (ch = fgetc(keys)) != EOF) typeKey(translateKey(ch));
+  if (!runToPrompt()){
+    fprintf(stderr, "no prompt to start from\n");
+    return(1);
+  }
+  memset(written, WRITTEN, 2 * RAMSIZE >> 8);
+  firstSeen(stateHash());
+  explore(0);
+  while (tally->live) usleep(1000);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%llu states, %llu new, %llu pruned, %llu leaves, %d workers, in %.3f s : %.0f states/hour\n",
+    (unsigned long long)tally->states, (unsigned long long)tally->fresh,
+    (unsigned long long)tally->pruned, (unsigned long long)tally->leaves, workers,
+    seconds, tally->states / seconds * 3600);
+  if (tally->full) fprintf(stderr, "%llu states not kept, the table is full\n",
+    (unsigned long long)tally->full);
+  return(0);
+}
+
+
+// INSTANCE POOL
+
+// -B FILE runs a batch of jobs, lines of "CYCLES [KEYFILE]", each from the
+// start state (the reset, or -i N) and printed after "----- job N". They
+// run on pools of -F N machines made once, see FLEET RUNNER : a machine
+// goes back to the
+// start state by copying only the pages written since (RESTORE in
+// written[]) and dropping their blocks, then its registers and switches.
+//
+// The RAM of a machine of the pool is a private mapping of one file with
+// the start state : all machines read the same pages, the kernel gives a
+// machine its own copy of a 4K page at its first write. The ROM is shared
+// already and the screen is only drawn when printed. -I N measures it :
+// N machines idle at the first prompt run -b cycles each (default 100000),
+// then the memory they take is printed, by machine.
+
+static void enterMachine(struct Machine *m){     // into the globals
+  MACHINESTATE(LOAD)
+  if (card80) mapBanks();
+  if (tier->readyCount) takeReady();
+}
+
+static void leaveMachine(struct Machine *m){
+  MACHINESTATE(SAVE)
+}
+
+int templateFd = -1;           // the RAM of the start state
+struct VideoChange poolLog[VIDEOLOGSIZE];  // not drawn by frame, one for all
+
+static void shareTemplate(const struct Snapshot *s){
+  FILE *f = tmpfile();
+  if (f && fwrite(s->ram, 1, 2 * RAMSIZE, f) == 2 * RAMSIZE && !fflush(f))
+    templateFd = dup(fileno(f));
+  if (f) fclose(f);                              // unlinked, the mappings keep it
+}
+
+static void addInstance(struct Machine *m, const struct Snapshot *s){
+  MACHINESTATE(SAVE)                             // the start state, but
+  m->ram = templateFd < 0 ? MAP_FAILED : mmap(NULL, 2 * RAMSIZE, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE, templateFd, 0);
+  if (m->ram == MAP_FAILED){                     // a copy then
+    m->ram = malloc(2 * RAMSIZE);
+    memcpy(m->ram, s->ram, 2 * RAMSIZE);
+  }
+  m->written = calloc(2, RAMSIZE >> 8);          // nothing to copy back
+  m->tier = calloc(1, sizeof(struct Tier));
+  m->videoLog = poolLog;
+  m->typed = NULL;
+  m->typedCount = m->typedSize = m->typedNext = 0;
+  m->profiling = false;
+}
+
+static int resetDirty(const struct Snapshot *s){  // back to s, the pages copied
+  int pages = (card80 ? 2 : 1) * (RAMSIZE >> 8), copied = 0;
+  uint64_t eight;
+  for (int p=0; p<pages; p++){
+    if (!(p & 7) && (memcpy(&eight, written + p, 8), !eight)){
+      p += 7;                                    // none of these 8
+      continue;
+    }
+    if (!(written[p] & RESTORE)) continue;
+    memcpy(ram + (p << 8), s->ram + (p << 8), 256);
+    written[p] = REHASH;
+    stale(p % (RAMSIZE >> 8) << 8);
+    copied++;
+  }
+  restoreDevices(s);
+  typedCount = typedNext = 0;
+  return(copied);
+}
+
+static bool readMemory(double kb[3]){            // Rss, Pss and Private_Dirty
+  static const char *names[3] = {"Rss:", "Pss:", "Private_Dirty:"};
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  int found = 0;
+  if (!f) return(false);
+  while (fgets(line, sizeof(line), f))
+    for (int n=0; n<3; n++)
+      if (!strncmp(line, names[n], strlen(names[n]))){
+        kb[n] = atof(line + strlen(names[n]));
+        found++;
+      }
+  fclose(f);
+  return(found == 3);
+}
+
+static int idleBench(int count, uint64_t cycles){  // -I N
+  struct Snapshot *origin = malloc(sizeof(struct Snapshot));
+  struct Machine *pool;
+  double before[3], after[3];
+  branchCycles = 20000000;
+  if (!runToPrompt()){
+    fprintf(stderr, "no prompt to start from\n");
+    return(1);
+  }
+  saveState(origin);
+  shareTemplate(origin);
+  if (!readMemory(before)){
+    fprintf(stderr, "no /proc/self/smaps_rollup\n");
+    return(1);
+  }
+  pool = calloc(count, sizeof(struct Machine));
+  for (int n=0; n<count; n++){
+    addInstance(&pool[n], origin);
+    enterMachine(&pool[n]);
+    for (uint64_t end=ticks + cycles; ticks<end;) step();
+    leaveMachine(&pool[n]);
+  }
+  readMemory(after);
+  fprintf(stderr, "%d idle machines, %llu cycles each : %.1f KB rss, %.1f KB pss, %.1f KB private by machine\n",
+    count, (unsigned long long)cycles, (after[0] - before[0]) / count,
+    (after[1] - before[1]) / count, (after[2] - before[2]) / count);
+  return(0);
+}
+
+
+// FLEET RUNNER
+
+// The jobs of -B are shared out to -P N workers (processes, see
+// STATE-SPACE EXPLORATION), in ranges of consecutive jobs. Each worker is
+// pinned to one of the CPUs the process may use and makes its pool once
+// pinned : the pages its machines write are taken from the memory of its
+// NUMA node. A worker takes the jobs of its range from the front, then
+// steals from the back of the others, first those on its node. Each job
+// prints its screens into a slot of shared memory, all are printed in order
+// at the end. The jobs run, jobs stolen and busy time of each worker are
+// printed on stderr, with the mean time of the resets and pages copied.
+
+#define JOBTEXT (2 * 24 * 81 + 32)  // the text of a job, at most
+
+struct Job{
+  unsigned long long cycles;
+  char *keyFile;                 // or NULL
+}*jobs = NULL;
+
+struct Worker{                   // in shared memory
+  _Atomic uint64_t range;        // jobs left : the first, then the end << 32
+  int cpu, node;
+  unsigned long long done, stolen, copied;
+  double busy, resetTime;        // ns, busy in CPU time
+}*workerStats;
+
+char *jobTexts;                  // JOBTEXT by job, shared
+int jobCount = 0, workerCount;
+
+static int cpuNode(int cpu){     // from sysfs, 0 without NUMA
+  char path[64];
+  struct dirent *e;
+  int node = 0;
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir) return(0);
+  while ((e = readdir(dir)))
+    if (!strncmp(e->d_name, "node", 4) && isdigit((unsigned char)e->d_name[4])) node = atoi(e->d_name + 4);
+  closedir(dir);
+  return(node);
+}
+
+static void placeWorkers(){      // the n-th allowed CPU for worker n
+  int count = 0;
+#ifdef __linux__
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) CPU_ZERO(&allowed);
+  for (int cpu=0; cpu<CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &allowed)) cpus[count++] = cpu;
+#else
+  int cpus[1];
+#endif
+  for (int n=0; n<workerCount; n++){
+    workerStats[n].cpu = count ? cpus[n % count] : -1;
+    workerStats[n].node = count ? cpuNode(workerStats[n].cpu) : 0;
+  }
+}
+
+static int takeJob(struct Worker *w, bool steal){  // the first, or the last
+  uint64_t range = atomic_load(&w->range), next;
+  uint32_t first, end;
+  do{
+    first = range, end = range >> 32;
+    if (first >= end) return(-1);
+    next = steal ? (uint64_t)(end - 1) << 32 | first : (uint64_t)end << 32 | (first + 1);
+  }while (!atomic_compare_exchange_weak(&w->range, &range, next));
+  return(steal ? end - 1 : first);
+}
+
+static int nextJob(int me){
+  int job = takeJob(&workerStats[me], false);
+  for (int pass=0; pass<2 && job<0; pass++)      // its node first
+    for (int k=1; k<workerCount && job<0; k++){
+      struct Worker *victim = &workerStats[(me + k) % workerCount];
+      if ((victim->node == workerStats[me].node) == !pass && (job = takeJob(victim, true)) >= 0)
+        workerStats[me].stolen++;
+    }
+  return(job);
+}
+
+static void runWorker(int me, const struct Snapshot *origin, int size){
+  struct Worker *w = &workerStats[me];
+  struct Machine *pool;
+  struct timespec before, reset, cpu0, cpu1;
+  FILE *keys, *out;
+  int job, ch;
+#ifdef __linux__
+  cpu_set_t cpu;
+  if (w->cpu >= 0){
+    CPU_ZERO(&cpu);
+    CPU_SET(w->cpu, &cpu);
+    sched_setaffinity(0, sizeof(cpu), &cpu);     // then the pool, on its node
+  }
+#endif
+  pool = calloc(size, sizeof(struct Machine));
+  for (int n=0; n<size; n++) addInstance(&pool[n], origin);
+  while ((job = nextJob(me)) >= 0){
+    struct Machine *m = &pool[w->done++ % size];
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    enterMachine(m);
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    w->copied += resetDirty(origin);
+    clock_gettime(CLOCK_MONOTONIC, &reset);
+    if (jobs[job].keyFile && (keys = fopen(jobs[job].keyFile, "rb"))){
+      while ((ch = fgetc(keys)) != EOF) typeKey(translateKey(ch));
+      fclose(keys);
+    }
+    for (uint64_t end=ticks + jobs[job].cycles; ticks<end;) step();
+    out = fmemopen(jobTexts + (size_t)job * JOBTEXT, JOBTEXT, "w");
+    fprintf(out, "----- job %d\n", job);
+    printScreen(out);
+    fclose(out);
+    leaveMachine(m);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    w->resetTime += (reset.tv_sec - before.tv_sec) * 1e9 + (reset.tv_nsec - before.tv_nsec);
+    w->busy += (cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec);
+  }
+}
+
+static int runBatch(const char *filename, int size, int count){
+  FILE *f = fopen(filename, "r");
+  struct Snapshot *origin = malloc(sizeof(struct Snapshot));
+  struct timespec start, end;
+  char line[4096], keyFile[4096];
+  unsigned long long cycles, copied = 0, done = 0;
+  double resetTime = 0, seconds;
+  pid_t pids[count];
+  int fields;
+  if (!f){
+    fprintf(stderr, "can't open %s\n", filename);
+    return(1);
+  }
+  while (fgets(line, sizeof(line), f))
+    if ((fields = sscanf(line, "%llu %4095s", &cycles, keyFile)) >= 1){
+      jobs = realloc(jobs, (jobCount + 1) * sizeof(struct Job));
+      jobs[jobCount++] = (struct Job){cycles, fields == 2 ? strdup(keyFile) : NULL};
+    }
+  fclose(f);
+  workerCount = count;
+  workerStats = mmap(NULL, count * sizeof(struct Worker), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  jobTexts = mmap(NULL, (jobCount + 1) * (size_t)JOBTEXT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (workerStats == MAP_FAILED || jobTexts == MAP_FAILED) return(1);
+  for (int n=0; n<count; n++)
+    workerStats[n].range = (uint64_t)((n + 1) * (uint64_t)jobCount / count) << 32 | n * (uint64_t)jobCount / count;
+  placeWorkers();
+  saveState(origin);
+  shareTemplate(origin);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int n=1; n<count; n++)
+    if ((pids[n] = forkWorker()) == 0){
+      runWorker(n, origin, size);
+      _exit(0);
+    }
+  runWorker(0, origin, size);
+  for (int n=1; n<count; n++) if (pids[n] > 0) waitpid(pids[n], NULL, 0);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  for (int job=0; job<jobCount; job++)
+    fwrite(jobTexts + (size_t)job * JOBTEXT, 1, strnlen(jobTexts + (size_t)job * JOBTEXT, JOBTEXT), stdout);
+  for (int n=0; n<count; n++){
+    struct Worker *w = &workerStats[n];
+    fprintf(stderr, "worker %d : cpu %d node %d, %llu jobs, %llu stolen, %.0f%% busy\n",
+      n, w->cpu, w->node, w->done, w->stolen, w->busy / 1e7 / seconds);
+    done += w->done;
+    copied += w->copied;
+    resetTime += w->resetTime;
+  }
+  if (done) fprintf(stderr, "%llu jobs on %d workers of %d machines in %.3f s, resets of %.0f ns copying %.1f pages\n",
+    done, count, size, seconds, resetTime / done, (double)copied / done);
+  return(0);
+}
+
+
+// PROGRAM ENTRY POINT
+
+int main(int argc, char *argv[]) {
+
+  int ch;
+  bool paused = false;
+  uint64_t frame = 0;
+  uint64_t budget = 0;
+  FILE *keys[MACHINES] = {NULL};
+  int linked = 1;
+  const char *romFile = "appleII.rom", *profileFile = NULL, *cacheFile = NULL;
+  const char *guestFile = NULL, *storeDir = NULL, *reportDir = NULL;
+  const char *exploreFile = NULL, *batchFile = NULL;
+  long start = -1, keep = 0;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN), poolSize = 1, idle = 0;
+#ifdef COVERAGE
+  const char *coverageFile = "reinette-II.info";  // lcov tracefile
+  startCoverage();
+#endif
+
+  // command line : -w ADDR to set the watched address (hex) for reverse-continue
+  //                -l to check each instruction against the reference core
+  //                -c FILE and -s LISTING for the coverage build
+  //                -b CYCLES and -k FILE for a headless run
+  //                -r FILE to load another ROM, -p FILE to profile BASIC lines
+  //                -j FILE and -J DEVICE for the joystick
+  //                -x for the 80-column card, -n to interpret all ROM loops
+  //                -m FILE for the memory card
+  //                -L FILE for one more machine on the serial cable, its keys
+  //                -t FILE for the translation cache
+  //                -g FILE for the guest profile, -s LISTING for its symbols
+  //                -S DIR for the snapshot store, -i N to start from one
+  //                -Z DIR to report a store, -K N to keep its N newest
+  //                -M DIR for the job memo cache
+  //                -e FILE to explore inputs, -d N deep, with -P N workers
+  //                -B FILE for a batch of jobs, -F N machines by worker
+  //                -I N to measure the memory of N idle machines
+  for (int i=1; i<argc; i++){
+    if (!strcmp(argv[i], "-b") && i+1 < argc) budget = strtoull(argv[++i], NULL, 10);
+    if (!strcmp(argv[i], "-k") && i+1 < argc) keys[0] = fopen(argv[++i], "rb");
+    if (!strcmp(argv[i], "-L") && i+1 < argc && linked < MACHINES) keys[linked++] = fopen(argv[++i], "rb");
+    if (!strcmp(argv[i], "-w") && i+1 < argc) watch = strtol(argv[++i], NULL, 16) & 0xFFFF;
+    if (!strcmp(argv[i], "-l")) lockstep = true;
+    if (!strcmp(argv[i], "-x")) card80 = true;
+    if (!strcmp(argv[i], "-n")) natives = false;
+    if (!strcmp(argv[i], "-m") && i+1 < argc && !openMapFile(argv[++i])){
+      fprintf(stderr, "can't map %s\n", argv[i]);
+      return(1);
+    }
+    if (!strcmp(argv[i], "-r") && i+1 < argc) romFile = argv[++i];
+    if (!strcmp(argv[i], "-p") && i+1 < argc) profileFile = argv[++i];
+    if (!strcmp(argv[i], "-t") && i+1 < argc) cacheFile = argv[++i];
+    if (!strcmp(argv[i], "-g") && i+1 < argc) guestFile = argv[++i];
+    if (!strcmp(argv[i], "-S") && i+1 < argc) storeDir = argv[++i];
+    if (!strcmp(argv[i], "-i") && i+1 < argc) start = strtol(argv[++i], NULL, 10);
+    if (!strcmp(argv[i], "-Z") && i+1 < argc) reportDir = argv[++i];
+    if (!strcmp(argv[i], "-K") && i+1 < argc) keep = strtol(argv[++i], NULL, 10);
+    if (!strcmp(argv[i], "-M") && i+1 < argc) memoDir = argv[++i];
+    if (!strcmp(argv[i], "-e") && i+1 < argc) exploreFile = argv[++i];
+    if (!strcmp(argv[i], "-d") && i+1 < argc) maxDepth = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-P") && i+1 < argc) workers = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-B") && i+1 < argc) batchFile = argv[++i];
+    if (!strcmp(argv[i], "-F") && i+1 < argc) poolSize = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-I") && i+1 < argc) idle = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-j") && i+1 < argc) readJoyScript(argv[++i]);
+    if (!strcmp(argv[i], "-J") && i+1 < argc) openJoyDevice(argv[++i]);
+#ifdef COVERAGE
+    if (!strcmp(argv[i], "-c") && i+1 < argc) coverageFile = argv[++i];
+#endif
+    if (!strcmp(argv[i], "-s") && i+1 < argc) readListing(argv[++i]);
+  }
+
+  if (reportDir) return(reportStore(reportDir, keep));
+  if (storeDir && !openStore(storeDir)){
+    fprintf(stderr, "can't open store %s\n", storeDir);
+    return(1);
+  }
+  if (start >= 0 && !storeDir){
+    fprintf(stderr, "-i takes a store, -S DIR\n");
+    return(1);
+  }
+
+  // load the original Apple][ ROM, including the Programmer's Aid at $D000
+  FILE *f=fopen(romFile,"rb");
+  if (f != NULL) fread(rom, sizeof(uint8_t), ROMSIZE, f);
+  fclose(f);
+
+  // Applesoft's token table starts with END at $D0D0
+  applesoft = !memcmp(rom + 0xD0D0 - ROMSTART, "EN\xC4", 3);
+  preadInRom = !memcmp(rom + PREAD - ROMSTART,
+    "\xAD\x70\xC0\xA0\x00\xEA\xEA\xBD\x64\xC0\x10\x04\xC8\xD0\xF8\x88\x60", 17);
+#ifdef COVERAGE
+  preadInRom = false;                            // its loop is covered
+#endif
+  findNatives();
+  startDecoder();
+  if (cacheFile) loadCache(cacheFile);
+  if (guestFile){
+    sampleDue = SAMPLECYCLES;
+    writePerfMap();
+  }
+  if (profileFile){
+    lineStats = calloc(65536, sizeof(struct LineStat));
+    profiling = true;
+  }
+  if (linked > 1 && lockstep){
+    fprintf(stderr, "-l takes a single machine\n");
+    return(1);
+  }
+  while (machineCount < linked) addMachine();
+
+  // processor reset
+  for (int n=machineCount-1; n>0; n--) switchMachine(n), reset();
+  switchMachine(0);
+  reset();
+  syncReference();
+  if (start >= 0){
+    if (!loadStored(start)){
+      fprintf(stderr, "can't start from snapshot %ld\n", start);
+      return(1);
+    }
+    if (budget) budget += ticks;                 // -b counts from there
+  }
+  takeSnapshot();
+
+  if ((exploreFile || batchFile || idle) && (linked > 1 || lockstep)){
+    fprintf(stderr, "-e, -B and -I take a single machine, without -l\n");
+    return(1);
+  }
+  if (idle > 0) return(idleBench(idle, budget ? budget : 100000));
+  if (batchFile || exploreFile){
+    int status = batchFile ? runBatch(batchFile, poolSize < 1 ? 1 : poolSize, workers < 1 ? 1 : workers)
+      : exploreAll(exploreFile, keys[0], budget ? budget : 20000000, workers < 1 ? 1 : workers);
+#ifdef COVERAGE
+    writeCoverage(coverageFile);                 // of all the workers
+#endif
+    return(status);
+  }
+
+  if (budget){
+    if (memoDir && (profileFile || guestFile || storeDir || lockstep || mapData || joyDevice >= 0)){
+      fprintf(stderr, "-M ignored : the job has other outputs or inputs\n");
+      memoDir = NULL;
+    }
+    headless(budget, keys);
+    if (storeDir) takeSnapshot();                // the final state
+    if (profileFile) writeProfile(profileFile);
+    if (cacheFile) saveCache(cacheFile);
+    if (guestFile) writeGuestProfile(guestFile);
+#ifdef COVERAGE
+    writeCoverage(coverageFile);
+#endif
+    return(0);
+  }
+
+  // ncurses initialization
+  initscr();
+  raw();
+  noecho();
+  curs_set(0);
+  qiflush();
+  keypad   (stdscr, TRUE);
+  nodelay  (stdscr, TRUE);
+  scrollok (stdscr, FALSE);
+  if (has_colors()){                             // pairs for lo-res, fg*8+bg
+    start_color();
+    for (int pair=1; pair<64; pair++) init_pair(pair, pair / 8, pair % 8);
+  }
+
+  // main loop
+  while(1){
+    if (!paused){
+      if (machineCount > 1) runMachines(timeline + QUANTUM);
+      else {
+        for (int i=0; i<100; i++) step(); // execute 100 instructions before a kbd scan
+        if (ticks >= snapshot(snapCount - 1)->ticks + SNAPINTERVAL) takeSnapshot();
+      }
+      if (ticks >= joyDue) joystick();
+      if (ticks >= sampleDue) sample();
+    }
+
+    // slow down emulation
+    napms(paused ? 10 : 0.6);
+
+    // keyboard controller, a paste is queued at once
+    while ((ch = getch()) != ERR){
+      if (ch == KEY_F(12)){                              // F12, exit program
+        endwin();
+#ifdef COVERAGE
+        writeCoverage(coverageFile);
+#endif
+        if (profileFile) writeProfile(profileFile);
+        if (cacheFile) saveCache(cacheFile);
+        if (guestFile) writeGuestProfile(guestFile);
+        return(0);
+      }
+      if (ch == KEY_F( 9) && !paused){                   // F9, next machine
+        switchMachine((current + 1) % machineCount);
+        dirtyRows[0] = dirtyRows[1] = ALLROWS;
+        continue;
+      }
+      if (machineCount > 1 && (ch == KEY_F(5) || ch == KEY_F(6))) continue;
+      if (ch == KEY_F( 5)) paused = true, reverseStep();     // F5, step back
+      if (ch == KEY_F( 6)) paused = true, reverseContinue(); // F6, back to watch
+      if (ch == KEY_F( 8) && paused){                    // F8, resume
+        paused = false;
+        forgetFuture();
+        move(24, 0);
+        clrtoeol();
+      }
+      if (paused){                                       // debugger status line
+        attrset(A_NORMAL);
+        mvprintw(24, 0, "PAUSED cycle %llu  PC:%04X A:%02X X:%02X Y:%02X SR:%02X SP:%02X",
+          (unsigned long long)ticks, reg.PC, reg.A, reg.X, reg.Y, reg.SR, reg.SP);
+        clrtoeol();
+      }
+      else {
+        if (ch == KEY_F( 7)) { reset(); logEvent(EV_RESET, 0); } // F7, reset
+        else typeKey(translateKey(ch));
+      }
+    }
+
+    // video controller, once per frame
+    if (ticks / FRAMECYCLES != frame || paused){
+      frame = ticks / FRAMECYCLES;
+      endFrame();
+      for (int row=0; row<24; row++)                     // rows that changed
+        if (drawRow(row)) mvaddchnstr(row, 0, screen[row], 80);
+      dirtyRows[0] = dirtyRows[1] = 0;
+    }
+  }
+}
+
+#endif